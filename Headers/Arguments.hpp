@@ -0,0 +1,10 @@
+#pragma once
+
+#include "Types.hpp"
+
+namespace Core
+{
+	// Command line values, the whole argument has to be a valid number or the value is left unchanged
+	bool ReadInteger(s32& i, char const* s);
+	bool ReadFloat(f32& f, char const* s);
+}
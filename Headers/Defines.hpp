@@ -3,6 +3,47 @@
 #define SIZEX 640
 #define SIZEY 480
 
+// Side of the square screen tiles used by the binned rasterizer
+#define TILE_SIZE 32
+// Side of the pixel blocks tested against the triangle edges before single pixels, 4 or 8
+#define BLOCK_SIZE 8
+#define TILE_BLOCKS (TILE_SIZE / BLOCK_SIZE)
+
+// Rasterize with integer edge equations and FP32 interpolation instead of floats,
+// for Sedna builds whose floating point bugs crash the renderer
+//#define FIXED_RASTER
+// Sub-pixel precision of the fixed point rasterizer
+#define SUBPIXEL_BITS 4
+
+// Triangles per culling cluster, for models converted without cluster data
+#define CLUSTER_SIZE 128
+
+// Draw the triangles front to back so the depth tests reject as much as possible
+#define SORT_TRIANGLES
+
+// Draw the skybox after the triangles of each tile, only on the pixels they left uncovered
+#define SKYBOX_LAST
+
+// Rasterize each tile into a visibility buffer first, then texture and light every covered pixel once
+//#define DEFERRED_SHADING
+// Upper bound for the -j option
+#define MAX_WORKERS 32
+// Upper bound for the -p option
+#define MAX_FRAME_BUFFERS 3
+
+// Sample the model texture from a mip chain built at load time, one level per triangle with nearest filtering
+#define MIPMAPS
+// Store the textures in 4x4 texel blocks of one cache line each, so that sampling across rows stays in cache
+#define BLOCK_TEXTURES
+
+// Light the pixels with a specular lookup table and approximate normalization rather than powf and square roots
+#define FAST_LIGHTING
+// Convert the textures and the skybox to the Pixel format at load time, halving their size
+// and letting the shading write final pixels without going through 24 bit colors
+#define NATIVE_TEXTURES
+// Ordered dithering of the shaded colors, hides the banding of r5g6b5 gradients
+//#define DITHER
+
 #define TEX_REPEAT
 #define TEX_ALPHA
 #define SPECULAR
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "Types.hpp"
+
+// Destination of the upscaled frames, usually /dev/fb0.
+// The framebuffer is mapped in memory when possible so the upscaler can write straight into it,
+// otherwise whole frames are written through the file descriptor.
+class FrameOutput
+{
+public:
+	FrameOutput() {};
+	~FrameOutput();
+
+	// Regular files are accepted as a stand-in for the device and are sized to hold one SIZEX * SIZEY frame
+	bool Open(const char* path, bool allowMap = true);
+	void Close();
+
+	// Mapped screen memory, or NULL when frames have to go through Write
+	u16* GetPixels() const { return pixels; }
+	// Distance between two rows of the screen, in pixels
+	u32 GetStride() const { return stride; }
+	// Part of the screen covered by the renderer, at most SIZEX * SIZEY
+	u32 GetWidth() const { return width; }
+	u32 GetHeight() const { return height; }
+
+	// Writes the given area of a frame made of SIZEX pixels wide rows
+	void Write(const u16* frame, u32 x, u32 y, u32 w, u32 h);
+
+private:
+	int fd = -1;
+	u8* map = NULL;
+	size_t mapSize = 0;
+	u16* pixels = NULL;
+	size_t offset = 0;
+	u32 stride = 0;
+	u32 width = 0;
+	u32 height = 0;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Maths/Maths.hpp"
+#include "Resources/ModelLoader.hpp"
+#include "Defines.hpp"
+#include "Pixel.hpp"
+
+#ifdef FAST_LIGHTING
+// Entries of the specular table, spread evenly over the cosines giving a visible highlight
+#define SPECULAR_STEPS 1024
+
+// Approximation of 1 / sqrt(x) from the bit pattern of x, refined by two Newton steps.
+// One step leaves 0.2% of error, which the specular exponent turns into visible banding
+inline f32 FastRsqrt(f32 x)
+{
+	union
+	{
+		f32 f;
+		u32 i;
+	} bits = { x };
+	bits.i = 0x5f375a86 - (bits.i >> 1);
+	f32 y = bits.f;
+	y = y * (1.5f - 0.5f * x * y * y);
+	return y * (1.5f - 0.5f * x * y * y);
+}
+#endif
+
+// Lighting of the model by a single directional light, using the material of the model
+class Lighting
+{
+public:
+	Lighting() {};
+	void Init(const Resources::Material& material);
+
+	// Lit color of a texel, both given in the channel ranges of Pixel.
+	// Neither vector has to be normalized, toCamera is only used with SPECULAR
+	inline Maths::Vec3 Shade(Maths::Vec3 color, Maths::Vec3 normal, Maths::Vec3 toCamera) const;
+
+private:
+	f32 shininess = 64.0f;
+#ifdef FAST_LIGHTING
+	// Specular intensity scaled to 255 for the cosines between the normal and the half vector from specularStart to 1,
+	// the smaller ones round to 0
+	u8 specular[SPECULAR_STEPS + 1];
+	f32 specularStart = 0;
+	f32 specularScale = 0;
+#endif
+};
+
+extern const Maths::Vec3 lightDir;
+
+inline Maths::Vec3 Lighting::Shade(Maths::Vec3 color, Maths::Vec3 normal, Maths::Vec3 toCamera) const
+{
+#ifdef FAST_LIGHTING
+	normal = normal * FastRsqrt(normal.Dot(normal));
+#else
+	normal = normal.Normalize();
+#endif
+	f32 deltaA = (lightDir.Dot(normal));
+	deltaA *= 0.75f;
+	deltaA += 0.25f;
+	if (deltaA < 0.1f) deltaA = 0.1f;
+	color = color * deltaA;
+#ifdef SPECULAR
+#ifdef FAST_LIGHTING
+	const Maths::Vec3 view = toCamera * FastRsqrt(toCamera.Dot(toCamera));
+	Maths::Vec3 halfV = lightDir + view;
+	halfV = halfV * FastRsqrt(halfV.Dot(halfV));
+	const f32 cosine = normal.Dot(halfV);
+	const f32 deltaB = cosine > specularStart ? specular[(u32)((Maths::Util::MinF(cosine, 1.0f) - specularStart) * specularScale + 0.5f)] : 0.0f;
+#else
+	const Maths::Vec3 view = toCamera.Normalize();
+	Maths::Vec3 halfV = (lightDir + view).Normalize();
+	f32 deltaB = powf(Maths::Util::MaxF(normal.Dot(halfV), 0), shininess);
+	deltaB *= 255;
+#endif
+	// deltaB is scaled to 255
+	color = color + Maths::Vec3(redMax, greenMax, blueMax) * (deltaB * (1.0f / 255));
+#else
+	(void)toCamera;
+#endif
+	return color;
+}
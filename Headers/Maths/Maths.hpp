@@ -185,6 +185,12 @@ namespace Maths
 
         Vec4 operator*(const Vec4& a) const;
             ;
+
+        // Batch versions of operator* for count vectors stored as separate x, y and z arrays,
+        // points are transformed with w = 1 and directions with w = 0. Outputs must not overlap the inputs.
+        void TransformPoints(const f32* x, const f32* y, const f32* z, f32* outX, f32* outY, f32* outZ, u32 count) const;
+        void TransformDirections(const f32* x, const f32* y, const f32* z, f32* outX, f32* outY, f32* outZ, u32 count) const;
+
         static Mat4 Identity();
 
         static Mat4 CreateTransformMatrix(const Vec3& position, const Vec3& rotation, const Vec3& scale);
@@ -305,6 +311,10 @@ namespace Maths
 
         inline f32 MaxF(f32 a, f32 b);
 
+        inline s32 MinI(s32 a, s32 b);
+
+        inline s32 MaxI(s32 a, s32 b);
+
         inline u32 ULog2(u32 a);
     };
 }
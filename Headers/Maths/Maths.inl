@@ -576,6 +576,20 @@ namespace Maths
         return b;
     }
 
+    inline s32 Util::MinI(s32 a, s32 b)
+    {
+        if (a > b)
+            return b;
+        return a;
+    }
+
+    inline s32 Util::MaxI(s32 a, s32 b)
+    {
+        if (a > b)
+            return a;
+        return b;
+    }
+
     inline u32 Util::ULog2(u32 a)
     {
         u32 result = 0;
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Types.hpp"
+
+// Native pixel format of the color buffer, r5g6b5 on Sedna.
+// Windows keeps 0x00RRGGBB words but with the same precision, so both render the same colors.
+#ifdef _WIN32
+using Pixel = u32;
+#else
+using Pixel = u16;
+#endif
+
+// Largest values of the red, green and blue channels of a Pixel
+const u32 redMax = 31;
+const u32 greenMax = 63;
+const u32 blueMax = 31;
+
+inline Pixel PackColor(const u32 value)
+{
+#ifdef _WIN32
+	return value & 0x00f8fcf8;
+#else
+	return ((value & 0xF80000) >> 8) | ((value & 0xFC00) >> 5) | ((value & 0xF8) >> 3);
+#endif
+}
+
+// Packs channels already reduced to [0, redMax], [0, greenMax] and [0, blueMax]
+inline Pixel PackChannels(u32 r, u32 g, u32 b)
+{
+#ifdef _WIN32
+	return (r << 19) | (g << 10) | (b << 3);
+#else
+	return (Pixel)((r << 11) | (g << 5) | b);
+#endif
+}
+
+inline void UnpackChannels(Pixel p, u32& r, u32& g, u32& b)
+{
+#ifdef _WIN32
+	r = (p >> 19) & redMax;
+	g = (p >> 10) & greenMax;
+	b = (p >> 3) & blueMax;
+#else
+	r = p >> 11;
+	g = (p >> 5) & greenMax;
+	b = p & blueMax;
+#endif
+}
+
+// Texels failing the alpha test are stored as this color, which opaque texels never use
+const Pixel transparentPixel = PackChannels(0, 1, 0);
@@ -1,25 +1,136 @@
 #pragma once
 
+#include "Lighting.hpp"
 #include "Resources/ModelLoader.hpp"
 #include "Resources/Texture.hpp"
+#include "Tile.hpp"
+#include "WorkerPool.hpp"
 
 class RenderThread;
 
+// Mesh vertices transformed for the current frame, one attribute per array.
+// x and y are in screen pixels, z holds the inverse of the view depth and every other attribute is multiplied by it.
+struct ProjectedVertices
+{
+	f32* x = NULL;
+	f32* y = NULL;
+	f32* z = NULL;
+	f32* nx = NULL;
+	f32* ny = NULL;
+	f32* nz = NULL;
+	f32* u = NULL;
+	f32* v = NULL;
+#ifdef SPECULAR
+	f32* wx = NULL;
+	f32* wy = NULL;
+	f32* wz = NULL;
+#endif
+};
+
+#ifdef FIXED_RASTER
+// Edge values in 1 / 2^(2 * SUBPIXEL_BITS) square pixels
+typedef s64 EdgeValue;
+#else
+typedef f32 EdgeValue;
+#endif
+
+// Screen space triangle ready to be binned and rasterized.
+// Edge i goes between vertices i + 1 and i + 2, its value at pixel (x, y) is
+// edgeC[i] - edgeA[i] * (x - minX) - edgeB[i] * (y - minY) and is positive inside the triangle.
+struct TriangleSetup
+{
+	u32 indices[3];
+	EdgeValue edgeA[3];
+	EdgeValue edgeB[3];
+	EdgeValue edgeC[3];
+	// Bit i set when edge i is a top or left edge, pixels lying exactly on the other edges are not drawn
+	u8 topLeft;
+	// Inverse of the edge values sum, scaled by 2^60 in fixed point
+	EdgeValue area;
+	// Range of the depths the triangle can write, nearDepth being the largest
+	f32 nearDepth;
+	f32 farDepth;
+	// Coarse nearDepth, lower is closer
+	u16 depthKey;
+	// Texture level sampled by every pixel of the triangle
+	u8 mipLevel;
+	bool visible;
+	s32 minX, minY, maxX, maxY;
+};
+
 class Rasterizer
 {
 public:
 	Rasterizer() {};
-	void Init(const char* path, const char* skyboxPath = NULL);
+	// False when the model could not be loaded or its buffers allocated, DrawScreen then draws nothing
+	bool Init(const char* path, const char* skyboxPath, Maths::IVec2 res, u32 threads = 1);
 	~Rasterizer();
 
 	void DrawScreen(RenderThread* th, f32 dt);
-	void DrawSkybox(RenderThread* th, const Maths::Mat4& v);
+	void DrawSkybox(RenderThread* th, s32 startY, s32 endY);
 
 	bool HasSkyboxLoaded() const { return skybox.IsValid(); }
+	// Area covered by the triangles of the last frame, the rest of the screen was left untouched
+	const Rect& GetDrawnBounds() const { return drawnBounds; }
 
 private:
-	Resources::Triangle* tris = NULL;
+	Resources::ModelFile file;
+	Resources::Mesh mesh;
 	Resources::Texture texture;
 	Resources::Texture skybox;
+	Lighting lighting;
 	u32 triCount = 0;
+	bool ready = false;
+
+	Maths::Vec3 cameraPos;
+	ProjectedVertices projected;
+	u32* visibleClusters = NULL;
+	u32 visibleClusterCount = 0;
+	TriangleSetup* setups = NULL;
+
+	// State of the frame being drawn, shared with the worker tasks
+	RenderThread* target = NULL;
+	Maths::Mat4 model;
+	Maths::Mat4 modelView;
+	// Skybox direction of pixel (0, 0) and its change from one pixel to the next in x and y
+	Maths::Vec3 skyOrigin;
+	Maths::Vec3 skyStepX;
+	Maths::Vec3 skyStepY;
+
+	// Visible triangles in the order they are binned
+	u32* drawOrder = NULL;
+#ifdef SORT_TRIANGLES
+	u32* sortScratch = NULL;
+#endif
+	// Per tile lists of triangle indices, tile i owns binTris[binStart[i]..binStart[i + 1]]
+	u32* binStart = NULL;
+	u32* binTris = NULL;
+	u32 binCapacity = 0;
+	Maths::IVec2 tileCount;
+	Rect drawnBounds;
+	// One tile scratch per worker
+	Tile* tiles = NULL;
+	Core::WorkerPool workers;
+
+	void CullClusters();
+	void TransformVertices(u32 start, u32 end);
+	void SetupTriangles(u32 start, u32 end);
+	u8 SelectMipLevel(const TriangleSetup& s, f32 screenArea) const;
+#ifdef SORT_TRIANGLES
+	void SortTriangles(u32 count);
+#endif
+	void BinTriangles();
+	void DrawTile(Tile& tile, u32 index);
+	void RasterizeTriangle(Tile& tile, const TriangleSetup& s, u32 index);
+#ifdef DEFERRED_SHADING
+	void ShadeTile(Tile& tile);
+#endif
+#ifdef SKYBOX_LAST
+	void DrawSkyboxTile(Tile& tile);
+#endif
+
+	static void SkyboxTask(void* data, u32 worker, u32 task);
+	static void VertexTask(void* data, u32 worker, u32 task);
+	static void SetupTask(void* data, u32 worker, u32 task);
+	static void TileTask(void* data, u32 worker, u32 task);
 };
@@ -9,40 +9,71 @@
 #ifdef _WIN32
 #include <vector>
 #include <Windows.h>
+#else
+#include <pthread.h>
+#include "FrameOutput.hpp"
 #endif
 
 
 class RenderThread
 {
 public:
-	RenderThread(const char* file, const char* background, u32 scale);
+	RenderThread(const char* file, const char* background, u32 scale, u32 threads = 1, u32 buffers = 1);
 	RenderThread(u32 scale = 2);
 	~RenderThread();
 
 #ifdef _WIN32
 	void RenderFrame(HDC hdc, Maths::IVec2 resolution);
 #else
-	void RenderFrame(FILE* out);
+	void RenderFrame(FrameOutput* out);
+	// Blocks until every rendered frame has been written out
+	void FinishFrames();
 #endif
-	void SetColor(u32 x, u32 y, u32 color);
-	f32 GetDepth(u32 i);
-	void SetDepth(u32 i, f32 d);
+	void SetPixels(u32 x, u32 y, const Pixel* pixels, u32 count);
+	// Starts the tile with the clear values, only a skybox drawn before the triangles is read back from the frame
+	void LoadTile(Tile& tile);
+	void StoreTile(const Tile& tile);
+	// Clears the frame under a tile without triangles nor skybox
+	void ClearTile(const Tile& tile);
 	f32 GetTotalTime();
+	// False when the model or the buffers needed to render it could not be loaded
+	bool IsValid() const { return valid; }
 	const Maths::IVec2 getResolution() const { return Maths::IVec2(resX, resY); };
 private:
 	//std::chrono::steady_clock::time_point start;
 	u64 start;
 	const u32 scaleFactor;
 	const u32 resX, resY;
+	bool valid = false;
 	
 #ifdef _WIN32
 	std::vector<u32> outputBuffer;
-	u32 colorBuffer[SIZEX * SIZEY];
 #else
-	u16 colorBuffer[SIZEX * SIZEY];
+	// Upscaled frame, only used when the output cannot be mapped
 	u16 stagingBuffer[SIZEX * SIZEY];
+	// Area drawn in the frame currently on screen, in render pixels
+	Rect screenBounds = Rect(0, 0, SIZEX - 1, SIZEY - 1);
+
+	// With more than one frame buffer, frames are upscaled and written by a presenter thread
+	// while the next ones are rendered. Frame n always uses frames[n % frameCount].
+	pthread_t presenter;
+	pthread_mutex_t presentLock;
+	pthread_cond_t frameReady;
+	pthread_cond_t frameFree;
+	FrameOutput* presentOut = NULL;
+	u64 submitted = 0;
+	u64 presented = 0;
+	bool presenting = false;
+	bool stopPresenter = false;
 #endif
-	f32 depthBuffer[SIZEX * SIZEY];
+	Pixel* frames[MAX_FRAME_BUFFERS] = {};
+	u32 frameCount = 0;
+	Pixel* colorBuffer = NULL;
+	// Area drawn in each frame buffer by the last frame using it, in render pixels.
+	// Everything outside of it holds the clear color so it does not need to be written again.
+	Rect frameBounds[MAX_FRAME_BUFFERS];
+	// Area of the current frame buffer that may not hold the clear color before drawing
+	Rect staleBounds;
 
 	Rasterizer rasterizer;
 
@@ -50,11 +81,15 @@ private:
 	//Maths::Vec2 rotation = Maths::Vec2(static_cast<f32>(M_PI_2) - 1.059891f, 0.584459f);
 	//f32 fov = 3.55f;
 
-	void ClearScreen();
-	void ClearDBOnly();
+	// False when not even one frame buffer could be allocated
+	bool AllocateFrames(u32 count);
 #ifdef _WIN32
 	void CopyToScreen(HDC hdc, Maths::IVec2 res);
 #else
-	void CopyToScreen(FILE* out);
+	void CopyToScreen(const Pixel* frame, const Rect& area, FrameOutput* out);
+	void PresentFrame(u32 index, FrameOutput* out);
+	void StartPresenter(FrameOutput* out);
+	void StopPresenter();
+	static void* PresenterMain(void* arg);
 #endif
 };
\ No newline at end of file
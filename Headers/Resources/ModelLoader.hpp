@@ -1,39 +1,82 @@
 #pragma once
 
 #include <stdio.h>
+#if defined(_WIN32) || defined(MODEL_CONVERTER)
+#include <string>
+#endif
 
 #include "Maths/Maths.hpp"
 
 namespace Resources
 {
-	struct VertexData
+	// Run of consecutive triangles culled as a whole, with its own range of vertices
+	struct Cluster
 	{
-		Maths::Vec3 pos;
-		Maths::Vec3 norm;
-		Maths::Vec2 uv;
+		u32 firstTriangle;
+		u32 triangleCount;
+		u32 firstVertex;
+		u32 vertexCount;
+		// Bounding sphere
+		Maths::Vec3 center;
+		f32 radius;
+		// Normal cone: every triangle faces away from cameras for which
+		// dot(center - camera, coneAxis) >= coneCutoff * |center - camera| + radius
+		Maths::Vec3 coneAxis;
+		f32 coneCutoff;
 	};
 
-	struct TriangleData
+	// Deduplicated vertices stored one attribute per array, faces reference them through the index buffer.
+	// The arrays either live in block or point into the ModelFile they were read from.
+	struct Mesh
 	{
-		VertexData data[3];
+		u32 vertexCount = 0;
+		u32 indexCount = 0;
+		f32* x = NULL;
+		f32* y = NULL;
+		f32* z = NULL;
+		f32* nx = NULL;
+		f32* ny = NULL;
+		f32* nz = NULL;
+		f32* u = NULL;
+		f32* v = NULL;
+		// 16 bit indices are used whenever the vertex count allows it
+		u16* indices16 = NULL;
+		u32* indices32 = NULL;
+		u32 clusterCount = 0;
+		Cluster* clusters = NULL;
+		void* block = NULL;
+
+		u32 GetIndex(u32 i) const { return indices16 ? indices16[i] : indices32[i]; }
+		void Destroy();
 	};
 
-	struct Vertex
+	// Contents of a model file, mapped in memory when possible and read otherwise
+	struct ModelFile
 	{
-		Maths::Vec3 pos;
-		Maths::Vec3 norm;
-		Maths::Vec2 uv;
+		u32* data = NULL;
+		u32 size = 0;
+		bool mapped = false;
+
+		void Close();
 	};
 
-	struct Triangle
+	// Surface parameters of a model, from the material its obj file uses
+	struct Material
 	{
-		Vertex data[3];
+		// Specular exponent, the Ns value of the mtl file
+		f32 shininess = 64.0f;
 	};
 
 	struct ModelData
 	{
-		Triangle* faces = NULL;
+		// Kept open while the mesh or the texture use it in place
+		ModelFile file;
+		Mesh mesh;
+		Material material;
 		u32* tex = NULL;
+		// Level count of a texture stored ready to sample and pointing into the file, 0 when it was decoded from a png
+		// and still has to be prepared
+		u32 texLevels = 0;
 		u32* sky = NULL;
 		Maths::IVec2 tRes;
 		Maths::IVec2 sRes;
@@ -43,11 +86,14 @@ namespace Resources
 	{
 		u32 GetFileSize(FILE* in);
 		char* LoadFile(const char* path, u32* sizeOut);
+		bool OpenModelFile(const char* path, ModelFile& file);
 		bool SaveFile(const char* path, const u32* data, u32 size);
-		ModelData ParseModelFile(const char* source, const char* skybox, u32* triCount);
+		ModelData ParseModelFile(const char* source, const char* skybox);
 		void FreeImageData(u32* data);
-#ifdef _WIN32
-		void CreateModelFile(const char* source, const char* tex, const char* dest);
+#if defined(_WIN32) || defined(MODEL_CONVERTER)
+		// The texture is stored decoded unless decodeTexture is false, which keeps the smaller png file but makes loading slower.
+		// materialLibrary receives the path of the material library the obj file names, empty when it names none
+		bool CreateModelFile(const char* source, const char* tex, const char* dest, bool decodeTexture = true, std::string* materialLibrary = NULL);
 #endif
 	}
 }
@@ -1,31 +1,79 @@
 #pragma once
 
 #include "Maths/Maths.hpp"
+#include "Pixel.hpp"
+#include "Defines.hpp"
 
 namespace Resources
 {
+	// Enough levels for textures up to 32768 pixels wide
+	const u32 maxMipLevels = 16;
+
+	// One level of the mip chain, level 0 being the texture itself
+	struct MipLevel
+	{
+		u32* pixels = NULL;
+		// Same texels in the Pixel format, once the texture is converted
+		Pixel* native = NULL;
+		Maths::IVec2 resolution;
+		Maths::IVec2 lResolution;
+		// Texels between two rows, or blocks between two rows of blocks with BLOCK_TEXTURES
+		s32 stride = 0;
+	};
+
 	class Texture
 	{
 	public:
 		Texture();
-		Texture(u32* buffer, Maths::IVec2 res);
+		// Buffers that are not owned are left alone by Destroy
+		Texture(u32* buffer, Maths::IVec2 res, bool owned = true);
 		~Texture() {};
+		// Texture around levels already in the sampling layout, stored one after the other. They are used in place
+		static Texture FromLevels(void* texels, Maths::IVec2 res, u32 levelCount);
+		// Bits describing the sampling layout of this build, textures stored with another one have to be prepared again
+		static u32 SamplingLayout();
+		// Texels needed by FromLevels for a texture of that size, 0 when the level count does not fit it
+		static u64 LevelsSize(Maths::IVec2 res, u32 levelCount);
 
 		void Destroy();
-		bool IsValid() const { return buffer; }
+		bool IsValid() const { return buffer || native; }
+
+		// Brings a freshly decoded texture into the sampling layout: mip chain with MIPMAPS unless mipmaps is false,
+		// Pixel texels with NATIVE_TEXTURES
+		bool Prepare(bool mipmaps, bool alphaTest);
+		// Builds the smaller levels by averaging 2x2 texels of the previous one
+		bool GenerateMipmaps();
+		u32 GetMipCount() const { return mipCount; }
+		// Level holding about one texel per pixel, given the area in uv space covered by one pixel
+		u32 GetMipLevel(f32 uvPerPixel) const;
+		// Replaces every level by its Pixel version, which only the Pixel samplers read.
+		// With alphaTest, texels less than half opaque become transparentPixel
+		bool ConvertToPixels(bool alphaTest);
+		// Texels of a level as the samplers read them, with their size in bytes
+		const void* GetLevelTexels(u32 level, u64& bytes) const;
 
-		Maths::Vec3 SampleCube(Maths::Vec3 dir) const;
-		Maths::Vec4 Sample(Maths::Vec2 uv) const;
-		u32 SampleCubeRaw(Maths::Vec3 dir) const;
-		u32 SampleRaw(Maths::Vec2 uv) const;
+		// Samples count directions, starting at dir and moving by step for each one. They do not have to be normalized
+		void SampleCubeSpan(Maths::Vec3 dir, const Maths::Vec3& step, u32 count, Pixel* out) const;
+#ifdef NATIVE_TEXTURES
+		Pixel SamplePixel(Maths::Vec2 uv, u32 level = 0) const;
+#else
+		Maths::Vec4 Sample(Maths::Vec2 uv, u32 level = 0) const;
+#endif
 
 	private:
 		u32* buffer;
+		bool owned;
 		Maths::IVec2 resolution;
 		Maths::IVec2 lResolution;
+		MipLevel mips[maxMipLevels];
+		u32 mipCount;
+		// Levels 1 and up, in a single allocation owned by the texture
+		u32* mipBlock;
+		// Every level in the Pixel format, owned by the texture when owned is set
+		Pixel* native;
 
-		u32 GetIndexFromUV(Maths::Vec2 uv) const;
-		u32 GetIndexFromUVCubed(Maths::Vec2 uv) const;
-		Maths::IVec2 ProcessDirection(Maths::Vec3 dir) const;
+		bool ConvertToBlocks();
+		u32 GetIndexFromUV(Maths::Vec2 uv, const MipLevel& level) const;
+		u32 GetIndexFromUVCubed(Maths::Vec2 uv, u32 face) const;
 	};
 }
\ No newline at end of file
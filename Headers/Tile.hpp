@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Types.hpp"
+#include "Defines.hpp"
+#include "Pixel.hpp"
+#include "Maths/Maths.hpp"
+
+// Texels as sampled from the model texture, already in the Pixel format with NATIVE_TEXTURES
+#ifdef NATIVE_TEXTURES
+typedef Pixel Texel;
+#else
+typedef Maths::Vec4 Texel;
+#endif
+
+// Inclusive pixel rectangle, empty when min > max
+struct Rect
+{
+	s32 minX = 0;
+	s32 minY = 0;
+	s32 maxX = -1;
+	s32 maxY = -1;
+
+	Rect() {}
+	Rect(s32 x0, s32 y0, s32 x1, s32 y1) : minX(x0), minY(y0), maxX(x1), maxY(y1) {}
+
+	bool IsEmpty() const { return minX > maxX || minY > maxY; }
+
+	Rect Union(const Rect& other) const
+	{
+		if (IsEmpty()) return other;
+		if (other.IsEmpty()) return *this;
+		return Rect(minX < other.minX ? minX : other.minX, minY < other.minY ? minY : other.minY,
+			maxX > other.maxX ? maxX : other.maxX, maxY > other.maxY ? maxY : other.maxY);
+	}
+
+	Rect Intersection(const Rect& other) const
+	{
+		return Rect(minX > other.minX ? minX : other.minX, minY > other.minY ? minY : other.minY,
+			maxX < other.maxX ? maxX : other.maxX, maxY < other.maxY ? maxY : other.maxY);
+	}
+};
+
+// Screen tile rendered in one go, small enough for its color and depth to stay in L1
+struct Tile
+{
+	s32 x = 0;
+	s32 y = 0;
+	s32 w = 0;
+	s32 h = 0;
+	Pixel color[TILE_SIZE * TILE_SIZE];
+	f32 depth[TILE_SIZE * TILE_SIZE];
+#ifdef DEFERRED_SHADING
+	// Closest triangle of each pixel
+	u32 triangles[TILE_SIZE * TILE_SIZE];
+#ifdef TEX_ALPHA
+	// Texel of each pixel, already sampled for the alpha test
+	Texel texels[TILE_SIZE * TILE_SIZE];
+#endif
+#endif
+	// Coarse depth bounds of each BLOCK_SIZE block and of the whole tile, conservative:
+	// no pixel is further than blockMin or closer than blockMax
+	f32 blockMin[TILE_BLOCKS * TILE_BLOCKS];
+	f32 blockMax[TILE_BLOCKS * TILE_BLOCKS];
+	f32 minDepth = 0;
+#ifdef SKYBOX_LAST
+	// Bit x of row y is set once a triangle wrote pixel (x, y) of the tile
+	u32 coverage[TILE_SIZE];
+#endif
+};
+
+#ifdef SKYBOX_LAST
+// Width of a coverage row mask, shifting a mask by it is undefined
+#define COVERAGE_BITS 32
+static_assert(TILE_SIZE <= COVERAGE_BITS, "tile rows must fit in the coverage masks");
+static_assert(sizeof(Tile::coverage[0]) * 8 == COVERAGE_BITS, "coverage masks must be COVERAGE_BITS wide");
+#endif
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "Types.hpp"
+#include "Defines.hpp"
+
+namespace Core
+{
+	// Called once for every task index, worker is in [0, GetWorkerCount())
+	typedef void (*TaskCallback)(void* data, u32 worker, u32 task);
+
+	class WorkerPool
+	{
+	public:
+		WorkerPool() {};
+		~WorkerPool();
+
+		// Spawns count - 1 threads, the thread calling Run acts as worker 0
+		bool Init(u32 count);
+		void Destroy();
+
+		u32 GetWorkerCount() const { return workerCount; }
+
+		// Runs the callback for every task in [0, taskCount) and returns once all of them are done
+		void Run(TaskCallback callback, void* data, u32 taskCount);
+
+	private:
+		// Contiguous range of task indices, head in the low 32 bits and tail in the high 32 bits.
+		// The owner pops from the head while idle workers steal from the tail.
+		struct alignas(64) TaskQueue
+		{
+			std::atomic<u64> range;
+		};
+
+		struct WorkerInfo
+		{
+			WorkerPool* pool;
+			u32 index;
+		};
+
+		TaskQueue queues[MAX_WORKERS];
+		u32 workerCount = 1;
+		TaskCallback callback = NULL;
+		void* callbackData = NULL;
+
+#ifndef _WIN32
+		pthread_t threads[MAX_WORKERS];
+		WorkerInfo infos[MAX_WORKERS];
+		pthread_mutex_t lock;
+		pthread_cond_t wake;
+		pthread_cond_t done;
+		u32 generation = 0;
+		u32 busy = 0;
+		bool quit = false;
+
+		static void* ThreadMain(void* arg);
+#endif
+
+		void Work(u32 worker);
+		bool Pop(u32 worker, u32& task);
+		bool Steal(u32 victim, u32& task);
+	};
+}
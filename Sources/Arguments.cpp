@@ -0,0 +1,31 @@
+#include "Arguments.hpp"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+
+bool Core::ReadInteger(s32& i, char const* s)
+{
+	char* end = NULL;
+	errno = 0;
+	const long tmp = strtol(s, &end, 0);
+	if (end == s || *end != '\0' || errno == ERANGE || tmp < INT_MIN || tmp > INT_MAX)
+	{
+		return false;
+	}
+	i = (s32)tmp;
+	return true;
+}
+
+bool Core::ReadFloat(f32& f, char const* s)
+{
+	char* end = NULL;
+	errno = 0;
+	const f32 tmp = strtof(s, &end);
+	if (end == s || *end != '\0' || errno == ERANGE)
+	{
+		return false;
+	}
+	f = tmp;
+	return true;
+}
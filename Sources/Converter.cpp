@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Types.hpp>
+#include <Arguments.hpp>
+#include <Defines.hpp>
+#include <WorkerPool.hpp>
+#include <Resources/ModelLoader.hpp>
+#include <Resources/Texture.hpp>
+
+const char* helpText =
+"Usage: convert-models [OPTIONS]... manifest\n"
+"Convert the obj models listed in the manifest to the binary format read by the rasterizer\n"
+"Each line of the manifest holds an obj file, its png texture and the output file, separated by spaces,\n"
+"optionally followed by \"png\" to keep the texture compressed. Lines starting with # are ignored.\n"
+"Options:\n"
+"-j			Set number of conversion threads, one per core by default\n"
+"-f			Convert every model, including the ones whose inputs did not change\n"
+"-c			Set the file keeping the hashes of the converted inputs (default: manifest.cache)\n"
+"--help		Display this information\n"
+"\n"
+"See https://github.com/getItemFromBlock/OC2Rasterizer/\n";
+
+// Changes whenever the converter writes different files from the same inputs, so that they get converted again
+const u64 converterRevision = 4;
+
+struct Parameters
+{
+	const char* manifest = NULL;
+	const char* cache = NULL;
+	s32 threads = 0;
+	bool force = false;
+};
+
+// Conversion described by one line of the manifest
+struct Entry
+{
+	const char* source = NULL;
+	const char* texture = NULL;
+	const char* output = NULL;
+	bool decodeTexture = true;
+	// Hash of the inputs and settings, and the one they had when the output was last written
+	u64 hash = 0;
+	u64 previousHash = 0;
+	// Material library named by the obj file, and the one it named when the output was last written
+	std::string library;
+	std::string previousLibrary;
+	bool failed = false;
+};
+
+struct Job
+{
+	Entry* entries = NULL;
+	u32 count = 0;
+	bool force = false;
+};
+
+bool ParseArgs(int argc, char* argv[], Parameters& params)
+{
+	for (s32 i = 1; i < argc; ++i)
+	{
+		if (!argv[i] || !argv[i][0])
+		{
+			printf("Error - null argument at index %d!", i);
+			return true;
+		}
+		if (!strcmp(argv[i], "--help"))
+		{
+			printf("%s", helpText);
+			return true;
+		}
+		if (argv[i][0] != '-')
+		{
+			params.manifest = argv[i];
+			continue;
+		}
+		switch (argv[i][1])
+		{
+		case 'j':
+			if (i + 1 == argc || !Core::ReadInteger(params.threads, argv[i + 1]) || params.threads <= 0 || params.threads > MAX_WORKERS)
+			{
+				printf("Error - thread count must be between 1 and %d\n", MAX_WORKERS);
+				return true;
+			}
+			++i;
+			break;
+		case 'f':
+			params.force = true;
+			break;
+		case 'c':
+			if (i + 1 == argc || !argv[i + 1] || !argv[i + 1][0])
+			{
+				printf("Error - cache must be a valid path\n");
+				return true;
+			}
+			params.cache = argv[i + 1];
+			++i;
+			break;
+		default:
+			printf("Warning - unknown option %s\n", argv[i]);
+			break;
+		}
+	}
+	if (params.manifest == NULL)
+	{
+		printf("Error - no manifest given\n");
+		return true;
+	}
+	return false;
+}
+
+// Splits the next space separated word of the line in place, NULL at the end of the line
+char* NextWord(char*& p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+	if (*p == '\0' || *p == '\n') return NULL;
+	char* word = p;
+	while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+	// a cut line ending leaves an empty line, which is enough to stop the next call
+	if (*p == '\n') *p = '\0';
+	else if (*p) *p++ = '\0';
+	return word;
+}
+
+// Reads the manifest into entries pointing into text, which has to outlive them
+bool ReadManifest(const char* path, char*& text, Entry*& entries, u32& count)
+{
+	u32 size = 0;
+	char* data = Resources::ModelLoader::LoadFile(path, &size);
+	if (data == NULL)
+	{
+		return false;
+	}
+	text = (char*)(malloc(size + 1));
+	if (text == NULL)
+	{
+		printf("Error - failed to allocate %d bytes\nOut of memory?", size + 1);
+		free(data);
+		return false;
+	}
+	u32 lines = 1;
+	for (u32 i = 0; i < size; i++)
+	{
+		lines += data[i] == '\n';
+	}
+	entries = new Entry[lines];
+	memcpy(text, data, size);
+	text[size] = '\0';
+	free(data);
+
+	count = 0;
+	u32 line = 1;
+	for (char* p = text; *p; line++)
+	{
+		char* end = strchr(p, '\n');
+		if (end) *end = '\0';
+		char* cursor = p;
+		p = end ? end + 1 : p + strlen(p);
+		char* first = NextWord(cursor);
+		if (first == NULL || first[0] == '#') continue;
+		Entry& e = entries[count];
+		e.source = first;
+		e.texture = NextWord(cursor);
+		e.output = NextWord(cursor);
+		char* option = e.texture && e.output ? NextWord(cursor) : NULL;
+		if (e.output == NULL || (option && strcmp(option, "png")))
+		{
+			printf("Error - line %d of %s should hold an obj file, a texture, an output and optionally \"png\"\n", line, path);
+			return false;
+		}
+		e.decodeTexture = option == NULL;
+		count++;
+	}
+	return true;
+}
+
+// Fills the previous hashes and material libraries of the entries from the cache file, which is missing on the first run
+void ReadCache(const char* path, Entry* entries, u32 count)
+{
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+	{
+		return;
+	}
+	char line[4096];
+	while (fgets(line, sizeof(line), file))
+	{
+		char* cursor = line;
+		char* hash = NextWord(cursor);
+		char* output = NextWord(cursor);
+		if (hash == NULL || output == NULL) continue;
+		// the library takes the rest of the line, its name can hold spaces
+		char* library = cursor;
+		size_t length = strlen(library);
+		while (length && (library[length - 1] == '\n' || library[length - 1] == '\r')) library[--length] = '\0';
+		for (u32 i = 0; i < count; i++)
+		{
+			if (strcmp(entries[i].output, output)) continue;
+			entries[i].previousHash = strtoull(hash, NULL, 16);
+			entries[i].previousLibrary = library;
+		}
+	}
+	fclose(file);
+}
+
+void WriteCache(const char* path, const Entry* entries, u32 count)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+	{
+		printf("Warning - cannot write cache %s\n", path);
+		printf("Error code : %d\n", errno);
+		return;
+	}
+	for (u32 i = 0; i < count; i++)
+	{
+		// failed conversions are left out so that the next run tries them again
+		if (entries[i].failed) continue;
+		const std::string& library = entries[i].library;
+		fprintf(file, "%016llx %s%s%s\n", (unsigned long long)entries[i].hash, entries[i].output, library.empty() ? "" : " ", library.c_str());
+	}
+	fclose(file);
+}
+
+// FNV-1a over the bytes
+u64 HashBytes(u64 hash, const u8* data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ data[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// Hashes the contents of the file a chunk at a time
+bool HashFile(const char* path, u64& hash)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		printf("Error - cannot open file %s\n", path);
+		printf("Error code : %d\n", errno);
+		return false;
+	}
+	u8 chunk[1 << 16];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+	{
+		hash = HashBytes(hash, chunk, read);
+	}
+	fclose(file);
+	return true;
+}
+
+// Hashes the material library, a missing one leaves the hash unchanged so that adding it converts the model again
+bool HashLibrary(const std::string& path, u64& hash)
+{
+	if (path.empty() || access(path.c_str(), F_OK) != 0) return true;
+	return HashFile(path.c_str(), hash);
+}
+
+void ConvertTask(void* data, u32, u32 task)
+{
+	Job* job = static_cast<Job*>(data);
+	Entry& e = job->entries[task];
+	// textures are stored in the sampling layout of the build, changing the texture options converts them again
+	const u64 settings[] = { converterRevision, CLUSTER_SIZE, e.decodeTexture, Resources::Texture::SamplingLayout() };
+	u64 hash = HashBytes(14695981039346656037ull, reinterpret_cast<const u8*>(settings), sizeof(settings));
+	if (!HashFile(e.source, hash) || !HashFile(e.texture, hash))
+	{
+		e.failed = true;
+		return;
+	}
+	// the library is only known once the obj file is parsed, an unchanged obj file still names the previous one
+	e.hash = hash;
+	if (!HashLibrary(e.previousLibrary, e.hash))
+	{
+		e.failed = true;
+		return;
+	}
+	if (!job->force && e.hash == e.previousHash && access(e.output, F_OK) == 0)
+	{
+		e.library = e.previousLibrary;
+		printf("%s is up to date\n", e.output);
+		return;
+	}
+	printf("Converting %s into %s\n", e.source, e.output);
+	e.failed = !Resources::ModelLoader::CreateModelFile(e.source, e.texture, e.output, e.decodeTexture, &e.library);
+	e.hash = hash;
+	e.failed |= !HashLibrary(e.library, e.hash);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		printf("%s", helpText);
+		return 0;
+	}
+
+	Parameters params;
+	if (ParseArgs(argc, argv, params))
+	{
+		return 1;
+	}
+
+	char* text = NULL;
+	Job job;
+	if (!ReadManifest(params.manifest, text, job.entries, job.count))
+	{
+		free(text);
+		delete[] job.entries;
+		return 1;
+	}
+	job.force = params.force;
+
+	char defaultCache[4096];
+	if (params.cache == NULL)
+	{
+		snprintf(defaultCache, sizeof(defaultCache), "%s.cache", params.manifest);
+		params.cache = defaultCache;
+	}
+	ReadCache(params.cache, job.entries, job.count);
+
+	// models are converted in parallel, each one on a single thread
+	if (params.threads == 0)
+	{
+		const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		params.threads = cores < 1 ? 1 : (cores > MAX_WORKERS ? MAX_WORKERS : (s32)cores);
+	}
+	Core::WorkerPool workers;
+	workers.Init(params.threads);
+	workers.Run(ConvertTask, &job, job.count);
+	workers.Destroy();
+
+	WriteCache(params.cache, job.entries, job.count);
+	u32 failures = 0;
+	for (u32 i = 0; i < job.count; i++)
+	{
+		failures += job.entries[i].failed;
+	}
+	if (failures)
+	{
+		printf("Error - %d of %d models failed to convert\n", failures, job.count);
+	}
+	free(text);
+	delete[] job.entries;
+	return failures ? 1 : 0;
+}
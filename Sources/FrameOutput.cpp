@@ -0,0 +1,129 @@
+#include "FrameOutput.hpp"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fb.h>
+
+#include "Defines.hpp"
+
+FrameOutput::~FrameOutput()
+{
+	Close();
+}
+
+bool FrameOutput::Open(const char* path, bool allowMap)
+{
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		printf("Error - cannot open output buffer %s\n", path);
+		printf("Error code: %d\n", errno);
+		return false;
+	}
+
+	fb_var_screeninfo vinfo;
+	fb_fix_screeninfo finfo;
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) == 0 && ioctl(fd, FBIOGET_FSCREENINFO, &finfo) == 0)
+	{
+		if (vinfo.bits_per_pixel != 16)
+		{
+			printf("Error - framebuffer uses %d bits per pixel, only r5g6b5 is supported\n", vinfo.bits_per_pixel);
+			Close();
+			return false;
+		}
+		width = vinfo.xres < SIZEX ? vinfo.xres : SIZEX;
+		height = vinfo.yres < SIZEY ? vinfo.yres : SIZEY;
+		stride = finfo.line_length / sizeof(u16);
+		offset = vinfo.yoffset * finfo.line_length + vinfo.xoffset * sizeof(u16);
+		mapSize = finfo.smem_len;
+	}
+	else
+	{
+		// not a framebuffer device, treat it as a file holding a single frame
+		struct stat info;
+		if (fstat(fd, &info) || !S_ISREG(info.st_mode))
+		{
+			printf("Error - %s is neither a framebuffer nor a regular file\n", path);
+			Close();
+			return false;
+		}
+		width = SIZEX;
+		height = SIZEY;
+		stride = SIZEX;
+		offset = 0;
+		mapSize = SIZEX * SIZEY * sizeof(u16);
+		if ((size_t)info.st_size < mapSize && ftruncate(fd, mapSize))
+		{
+			printf("Error - cannot resize output file %s\n", path);
+			Close();
+			return false;
+		}
+	}
+
+	if (allowMap)
+	{
+		void* ptr = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (ptr != MAP_FAILED)
+		{
+			map = static_cast<u8*>(ptr);
+			pixels = reinterpret_cast<u16*>(map + offset);
+		}
+		else
+		{
+			printf("Warning - cannot map output buffer (error %d), falling back to writes\n", errno);
+		}
+	}
+	return true;
+}
+
+void FrameOutput::Close()
+{
+	if (map)
+	{
+		munmap(map, mapSize);
+		map = NULL;
+		pixels = NULL;
+	}
+	if (fd >= 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+}
+
+static bool WriteAll(int fd, const void* data, size_t size, size_t offset)
+{
+	const u8* src = static_cast<const u8*>(data);
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t n = pwrite(fd, src + done, size - done, offset + done);
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR) continue;
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+void FrameOutput::Write(const u16* frame, u32 x, u32 y, u32 w, u32 h)
+{
+	// areas spanning most of the width are sent as whole rows in one go rather than one write per row
+	if (stride == SIZEX && w * 2 >= width)
+	{
+		const size_t start = (size_t)y * SIZEX;
+		WriteAll(fd, frame + start, (size_t)SIZEX * h * sizeof(u16), offset + start * sizeof(u16));
+		return;
+	}
+	for (u32 j = y; j < y + h; j++)
+	{
+		if (!WriteAll(fd, frame + j * SIZEX + x, w * sizeof(u16), offset + ((size_t)j * stride + x) * sizeof(u16))) return;
+	}
+}
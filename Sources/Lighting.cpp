@@ -0,0 +1,19 @@
+#include "Lighting.hpp"
+
+using namespace Maths;
+
+const Vec3 lightDir = Vec3(-3, 5, 2).Normalize();
+
+void Lighting::Init(const Resources::Material& material)
+{
+	shininess = material.shininess;
+#ifdef FAST_LIGHTING
+	// the table trades the powf of every lit pixel for one per entry, it starts where the highlight reaches half a unit
+	specularStart = powf(0.5f / 255, 1 / shininess);
+	specularScale = SPECULAR_STEPS / (1 - specularStart);
+	for (u32 i = 0; i <= SPECULAR_STEPS; i++)
+	{
+		specular[i] = (u8)(powf(specularStart + i / specularScale, shininess) * 255 + 0.5f);
+	}
+#endif
+}
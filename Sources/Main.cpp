@@ -4,7 +4,9 @@
 #include <string.h>
 
 #include <Types.hpp>
+#include <Arguments.hpp>
 #include <RenderThread.hpp>
+#include <FrameOutput.hpp>
 
 const char* helpText =
 "Usage: rasterizer [OPTIONS]... file\n"
@@ -13,6 +15,10 @@ const char* helpText =
 "-s			Set resolution scaling factor\n"
 "-t			Set max render time\n"
 "-b			Set next argument as the background image\n"
+"-o			Set the output framebuffer (default /dev/fb0), a regular file can be used instead\n"
+"-w			Write frames to the output instead of mapping it in memory\n"
+"-j			Set number of render threads\n"
+"-p			Set number of frame buffers, frames are written on their own thread when above 1\n"
 "--help		Display this information\n"
 "\n"
 "See https://github.com/getItemFromBlock/OC2Rasterizer/\n";
@@ -23,32 +29,12 @@ struct Parameters
 	const char* skybox = NULL;
 	f32 renderTime = 15;
 	s32 scale = 2;
+	s32 threads = 1;
+	s32 buffers = 1;
+	const char* output = "/dev/fb0";
+	bool mapOutput = true;
 };
 
-bool ReadInteger(s32& i, char const* s)
-{
-	char* ptr = NULL;
-	u32 tmp = strtol(s, &ptr, 0);
-	if (!ptr)
-	{
-		return false;
-	}
-	i = tmp;
-	return true;
-}
-
-bool ReadFloat(f32& i, char const* s)
-{
-	char* ptr = NULL;
-	f32 tmp = strtof(s, &ptr);
-	if (!ptr)
-	{
-		return false;
-	}
-	i = tmp;
-	return true;
-}
-
 bool ParseArgs(int argc, char* argv[], Parameters& params)
 {
 	for (s32 i = 1; i < argc; ++i)
@@ -70,7 +56,7 @@ bool ParseArgs(int argc, char* argv[], Parameters& params)
 		switch (argv[i][1])
 		{
 		case 's':
-			if (i + 1 == argc || !ReadInteger(params.scale, argv[i + 1]) || params.scale <= 0)
+			if (i + 1 == argc || !Core::ReadInteger(params.scale, argv[i + 1]) || params.scale <= 0)
 			{
 				printf("Error - scale must be a positive integer\n");
 				return true;
@@ -78,13 +64,41 @@ bool ParseArgs(int argc, char* argv[], Parameters& params)
 			++i;
 			break;
 		case 't':
-			if (i + 1 == argc || !ReadFloat(params.renderTime, argv[i + 1]))
+			if (i + 1 == argc || !Core::ReadFloat(params.renderTime, argv[i + 1]))
 			{
 				printf("Error - render time must be a number greater than 0\n");
 				return true;
 			}
 			++i;
 			break;
+		case 'j':
+			if (i + 1 == argc || !Core::ReadInteger(params.threads, argv[i + 1]) || params.threads <= 0 || params.threads > MAX_WORKERS)
+			{
+				printf("Error - thread count must be between 1 and %d\n", MAX_WORKERS);
+				return true;
+			}
+			++i;
+			break;
+		case 'p':
+			if (i + 1 == argc || !Core::ReadInteger(params.buffers, argv[i + 1]) || params.buffers <= 0 || params.buffers > MAX_FRAME_BUFFERS)
+			{
+				printf("Error - frame buffer count must be between 1 and %d\n", MAX_FRAME_BUFFERS);
+				return true;
+			}
+			++i;
+			break;
+		case 'o':
+			if (i + 1 == argc || !argv[i + 1] || !argv[i + 1][0])
+			{
+				printf("Error - output must be a valid path\n");
+				return true;
+			}
+			params.output = argv[i + 1];
+			++i;
+			break;
+		case 'w':
+			params.mapOutput = false;
+			break;
 		case 'b':
 			if (i + 1 == argc || !argv[i + 1] || !argv[i + 1][0])
 			{
@@ -117,14 +131,16 @@ int main(int argc, char* argv[])
 	}
 
     printf("Loading file %s\n", params.model);
-    RenderThread render = RenderThread(params.model, params.skybox, params.scale);
+    RenderThread render = RenderThread(params.model, params.skybox, params.scale, params.threads, params.buffers);
+    if (!render.IsValid())
+    {
+        return 1;
+    }
     printf("File loaded\n");
 
-    FILE* out = fopen("/dev/fb0", "wb");
-    if (out == NULL)
+    FrameOutput out;
+    if (!out.Open(params.output, params.mapOutput))
     {
-        printf("Error - cannot open output buffer\n");
-        printf("Error code: %d\n", errno);
         return 1;
     }
 
@@ -134,13 +150,14 @@ int main(int argc, char* argv[])
     {
         f32 start = render.GetTotalTime();
         printf("Rendering frame %d\n", frameCount);
-        render.RenderFrame(out);
+        render.RenderFrame(&out);
         f32 end = render.GetTotalTime();
         printf("Rendered in: %.2f, total time: %.2f\n", end-start, end);
         frameCount++;
     }
 
-    fclose(out);
+    render.FinishFrames();
+    out.Close();
 
     return 0;
 }
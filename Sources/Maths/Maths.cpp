@@ -2,6 +2,18 @@
 
 #include <stdio.h>
 
+// Vector path of the batch transforms, picked from the target flags at build time
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BATCH_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BATCH_SSE
+#elif defined(__riscv_vector) && defined(__riscv_v_intrinsic)
+#include <riscv_vector.h>
+#define BATCH_RVV
+#endif
+
 namespace Maths
 {
 
@@ -55,6 +67,90 @@ namespace Maths
         return out;
     }
 
+    // Rows are accumulated in the same order as operator* so both give the same results
+    static void TransformBatch(const f32* m, const f32* x, const f32* y, const f32* z, f32* outX, f32* outY, f32* outZ, u32 count, bool point)
+    {
+        u32 i = 0;
+#if defined(BATCH_AVX2)
+        __m256 c[9];
+        for (u32 k = 0; k < 9; k++) c[k] = _mm256_set1_ps(m[(k / 3) * 4 + k % 3]);
+        const __m256 t0 = _mm256_set1_ps(point ? m[12] : 0);
+        const __m256 t1 = _mm256_set1_ps(point ? m[13] : 0);
+        const __m256 t2 = _mm256_set1_ps(point ? m[14] : 0);
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m256 vx = _mm256_loadu_ps(x + i);
+            const __m256 vy = _mm256_loadu_ps(y + i);
+            const __m256 vz = _mm256_loadu_ps(z + i);
+            __m256 r0 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(c[0], vx), _mm256_mul_ps(c[3], vy)), _mm256_mul_ps(c[6], vz));
+            __m256 r1 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(c[1], vx), _mm256_mul_ps(c[4], vy)), _mm256_mul_ps(c[7], vz));
+            __m256 r2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(c[2], vx), _mm256_mul_ps(c[5], vy)), _mm256_mul_ps(c[8], vz));
+            _mm256_storeu_ps(outX + i, _mm256_add_ps(r0, t0));
+            _mm256_storeu_ps(outY + i, _mm256_add_ps(r1, t1));
+            _mm256_storeu_ps(outZ + i, _mm256_add_ps(r2, t2));
+        }
+#elif defined(BATCH_SSE)
+        __m128 c[9];
+        for (u32 k = 0; k < 9; k++) c[k] = _mm_set1_ps(m[(k / 3) * 4 + k % 3]);
+        const __m128 t0 = _mm_set1_ps(point ? m[12] : 0);
+        const __m128 t1 = _mm_set1_ps(point ? m[13] : 0);
+        const __m128 t2 = _mm_set1_ps(point ? m[14] : 0);
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128 vx = _mm_loadu_ps(x + i);
+            const __m128 vy = _mm_loadu_ps(y + i);
+            const __m128 vz = _mm_loadu_ps(z + i);
+            __m128 r0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[0], vx), _mm_mul_ps(c[3], vy)), _mm_mul_ps(c[6], vz));
+            __m128 r1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[1], vx), _mm_mul_ps(c[4], vy)), _mm_mul_ps(c[7], vz));
+            __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[2], vx), _mm_mul_ps(c[5], vy)), _mm_mul_ps(c[8], vz));
+            _mm_storeu_ps(outX + i, _mm_add_ps(r0, t0));
+            _mm_storeu_ps(outY + i, _mm_add_ps(r1, t1));
+            _mm_storeu_ps(outZ + i, _mm_add_ps(r2, t2));
+        }
+#elif defined(BATCH_RVV)
+        const f32 t0 = point ? m[12] : 0;
+        const f32 t1 = point ? m[13] : 0;
+        const f32 t2 = point ? m[14] : 0;
+        while (i < count)
+        {
+            const size_t vl = __riscv_vsetvl_e32m4(count - i);
+            const vfloat32m4_t vx = __riscv_vle32_v_f32m4(x + i, vl);
+            const vfloat32m4_t vy = __riscv_vle32_v_f32m4(y + i, vl);
+            const vfloat32m4_t vz = __riscv_vle32_v_f32m4(z + i, vl);
+            vfloat32m4_t r = __riscv_vfmul_vf_f32m4(vx, m[0], vl);
+            r = __riscv_vfmacc_vf_f32m4(r, m[4], vy, vl);
+            r = __riscv_vfmacc_vf_f32m4(r, m[8], vz, vl);
+            __riscv_vse32_v_f32m4(outX + i, __riscv_vfadd_vf_f32m4(r, t0, vl), vl);
+            r = __riscv_vfmul_vf_f32m4(vx, m[1], vl);
+            r = __riscv_vfmacc_vf_f32m4(r, m[5], vy, vl);
+            r = __riscv_vfmacc_vf_f32m4(r, m[9], vz, vl);
+            __riscv_vse32_v_f32m4(outY + i, __riscv_vfadd_vf_f32m4(r, t1, vl), vl);
+            r = __riscv_vfmul_vf_f32m4(vx, m[2], vl);
+            r = __riscv_vfmacc_vf_f32m4(r, m[6], vy, vl);
+            r = __riscv_vfmacc_vf_f32m4(r, m[10], vz, vl);
+            __riscv_vse32_v_f32m4(outZ + i, __riscv_vfadd_vf_f32m4(r, t2, vl), vl);
+            i += vl;
+        }
+#endif
+        const f32 w = point ? 1.0f : 0.0f;
+        for (; i < count; i++)
+        {
+            outX[i] = m[0] * x[i] + m[4] * y[i] + m[8] * z[i] + m[12] * w;
+            outY[i] = m[1] * x[i] + m[5] * y[i] + m[9] * z[i] + m[13] * w;
+            outZ[i] = m[2] * x[i] + m[6] * y[i] + m[10] * z[i] + m[14] * w;
+        }
+    }
+
+    void Mat4::TransformPoints(const f32* x, const f32* y, const f32* z, f32* outX, f32* outY, f32* outZ, u32 count) const
+    {
+        TransformBatch(content, x, y, z, outX, outY, outZ, count, true);
+    }
+
+    void Mat4::TransformDirections(const f32* x, const f32* y, const f32* z, f32* outX, f32* outY, f32* outZ, u32 count) const
+    {
+        TransformBatch(content, x, y, z, outX, outY, outZ, count, false);
+    }
+
     Mat4 Mat4::CreateXRotationMatrix(f32 angle)
     {
         Mat4 out = Mat4(1);
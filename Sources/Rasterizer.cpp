@@ -3,54 +3,362 @@
 #include "Maths/Maths.hpp"
 #include "Defines.hpp"
 #include "RenderThread.hpp"
+#ifdef FIXED_RASTER
+#include "Maths/FP32.hpp"
+#endif
+#ifdef SKYBOX_LAST
+#include <bit>
+#endif
 
 using namespace Maths;
 using namespace Resources;
 
-const Vec3 lightDir = Vec3(-3, 5, 2).Normalize();
+#ifdef NATIVE_TEXTURES
+inline Texel SampleTexel(const Texture& texture, Vec2 uv, u32 level)
+{
+    return texture.SamplePixel(uv, level);
+}
+
+inline bool TexelVisible(Texel t)
+{
+    return t != transparentPixel;
+}
+
+inline Vec3 TexelColor(Texel t)
+{
+    u32 r, g, b;
+    UnpackChannels(t, r, g, b);
+    return Vec3((f32)r, (f32)g, (f32)b);
+}
+#else
+inline Texel SampleTexel(const Texture& texture, Vec2 uv, u32 level)
+{
+    return texture.Sample(uv, level);
+}
+
+inline bool TexelVisible(const Texel& t)
+{
+    return t.w >= 0.5f;
+}
+
+inline Vec3 TexelColor(const Texel& t)
+{
+    return Vec3(t.x * (redMax / 255.0f), t.y * (greenMax / 255.0f), t.z * (blueMax / 255.0f));
+}
+#endif
+
+#ifdef DITHER
+// 4x4 Bayer matrix, shifted by half a step so that it averages to rounding
+const f32 ditherThresholds[16] = {
+    0.5f / 16, 8.5f / 16, 2.5f / 16, 10.5f / 16,
+    12.5f / 16, 4.5f / 16, 14.5f / 16, 6.5f / 16,
+    3.5f / 16, 11.5f / 16, 1.5f / 16, 9.5f / 16,
+    15.5f / 16, 7.5f / 16, 13.5f / 16, 5.5f / 16,
+};
+#endif
+
+// Amount added to the channels of a pixel before they are truncated to the Pixel format
+inline f32 DitherThreshold(s32 x, s32 y)
+{
+#ifdef DITHER
+    return ditherThresholds[(y & 3) * 4 + (x & 3)];
+#else
+    (void)x;
+    (void)y;
+    return 0.5f;
+#endif
+}
+
+#ifdef DEFERRED_SHADING
+// Visibility buffer value of the pixels no triangle covers
+const u32 noTriangle = ~0u;
+#endif
 
 float EdgeFunction(const Vec2 p, const Vec2 a, const Vec2 b)
 {
     return (p.x - a.x) * (b.y - a.y) - (p.y - a.y) * (b.x - a.x);
 }
 
-void Rasterizer::Init(const char* path, const char* skyboxPath)
+// Top-left fill rule: pixel centers lying exactly on an edge belong to the triangle on its top or left side
+inline bool EdgeInside(f32 w, u8 topLeft, u8 edge)
+{
+    return w > 0 || (w == 0 && (topLeft & (1 << edge)));
+}
+
+#ifdef FIXED_RASTER
+// Vertices are snapped to 1 / 2^SUBPIXEL_BITS pixels
+const s64 subPixels = 1 << SUBPIXEL_BITS;
+// Triangles reaching further than this are dropped, it keeps the edge equations well inside 64 bits
+const f32 guardBand = 1 << 19;
+// Same for vertices closer to the camera than 1 / maxInvDepth, as there is no near plane clipping
+const f32 maxInvDepth = 8;
+
+// Fixed point setups have the top-left bias folded into the edge values
+inline bool EdgeInside(s64 w, u8, u8)
+{
+    return w >= 0;
+}
+
+// Interpolates an attribute stored as {vertex 0, vertex 1 - vertex 0, vertex 2 - vertex 0} with 24 bit weights
+inline s64 FixedLerp(const s64* a, s64 b1, s64 b2)
+{
+    return a[0] + ((b1 * a[1] + b2 * a[2]) >> 24);
+}
+#endif
+
+// Vertex attributes of one triangle, gathered from the projected vertices before shading its pixels
+struct TriangleAttributes
+{
+#ifdef FIXED_RASTER
+    // every attribute is kept as its value on vertex 0 followed by the differences to vertices 1 and 2,
+    // 1 / z uses 32 fractional bits and the others the FP32 format
+#ifdef SPECULAR
+    s64 values[9][3];
+#else
+    s64 values[6][3];
+#endif
+#else
+    Vec3 points[3];
+    Vec3 normals[3];
+    Vec2 uvs[3];
+#ifdef SPECULAR
+    Vec3 spos[3];
+#endif
+#endif
+
+    void Load(const ProjectedVertices& o, const TriangleSetup& s)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            const u32 i = s.indices[k];
+#ifdef FIXED_RASTER
+            const s64 vertex[] = { (s64)(o.z[i] * 4294967296.0f), FP32(o.u[i]).value, FP32(o.v[i]).value,
+                FP32(o.nx[i]).value, FP32(o.ny[i]).value, FP32(o.nz[i]).value,
+#ifdef SPECULAR
+                FP32(o.wx[i]).value, FP32(o.wy[i]).value, FP32(o.wz[i]).value
+#endif
+            };
+            for (u32 j = 0; j < sizeof(values) / sizeof(values[0]); j++)
+            {
+                values[j][k] = k == 0 ? vertex[j] : vertex[j] - values[j][0];
+            }
+#else
+            points[k] = Vec3(o.x[i], o.y[i], o.z[i]);
+            normals[k] = Vec3(o.nx[i], o.ny[i], o.nz[i]);
+            uvs[k] = Vec2(o.u[i], o.v[i]);
+#ifdef SPECULAR
+            spos[k] = Vec3(o.wx[i], o.wy[i], o.wz[i]);
+#endif
+#endif
+        }
+    }
+};
+
+// Interpolation weights and depth of one pixel of a triangle
+struct PixelWeights
+{
+#ifdef FIXED_RASTER
+    // barycentric weights of vertices 1 and 2 with 24 fractional bits
+    s64 b1;
+    s64 b2;
+    FP32 fixedDepth;
+#else
+    Vec3 w;
+#endif
+    f32 depth;
+};
+
+#ifdef FIXED_RASTER
+// Perspective corrected value of an FP32 attribute
+inline f32 FixedAttribute(const s64* a, const PixelWeights& p)
+{
+    FP32 value;
+    value.value = (s32)(FixedLerp(a, p.b1, p.b2));
+    return (value * p.fixedDepth).ToFloat();
+}
+#endif
+
+// Weights and depth of the pixel with the given edge values, returns false when its depth is out of range
+inline bool PixelDepth(const TriangleSetup& s, const TriangleAttributes& a, EdgeValue w0, EdgeValue w1, EdgeValue w2, PixelWeights& p)
+{
+#ifdef FIXED_RASTER
+    (void)w0;
+    p.b1 = (w1 * s.area) >> 36;
+    p.b2 = (w2 * s.area) >> 36;
+    const s64 invDepth = FixedLerp(a.values[0], p.b1, p.b2);
+    if (invDepth < -((s64)1 << 32) || invDepth >= 0) return false;
+    const s64 depthValue = ((s64)1 << 49) / invDepth;
+    p.fixedDepth.value = depthValue < INT32_MIN ? INT32_MIN : (s32)(depthValue);
+    p.depth = p.fixedDepth.ToFloat();
+    return true;
+#else
+    p.w = Vec3(w0, w1, w2) * s.area;
+    f32 depth = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        depth += p.w[k] * a.points[k].z;
+    }
+    p.depth = 1 / depth;
+    return depth >= -1.0f && depth < 0.0f;
+#endif
+}
+
+inline Vec2 PixelUV(const TriangleAttributes& a, const PixelWeights& p)
 {
-    ModelData data = ModelLoader::ParseModelFile(path, skyboxPath, &triCount);
-    tris = data.faces;
-    texture = Texture(data.tex, data.tRes);
+#ifdef FIXED_RASTER
+    return Vec2(FixedAttribute(a.values[1], p), FixedAttribute(a.values[2], p));
+#else
+    Vec2 uv;
+    for (int k = 0; k < 3; k++)
+    {
+        uv = uv + a.uvs[k] * p.w[k];
+    }
+    return uv * p.depth;
+#endif
+}
+
+// Lights the texel of a pixel, given in the channel ranges of Pixel, and packs the result
+inline Pixel ShadePixel(const TriangleAttributes& a, const PixelWeights& p, Vec3 color, const Lighting& lighting, const Vec3& cameraPos, f32 threshold)
+{
+#ifdef FIXED_RASTER
+    const Vec3 normal = Vec3(FixedAttribute(a.values[3], p), FixedAttribute(a.values[4], p), FixedAttribute(a.values[5], p));
+#else
+    Vec3 normal;
+    for (int k = 0; k < 3; k++)
+    {
+        normal = normal + a.normals[k] * p.w[k];
+    }
+    normal = normal * p.depth;
+#endif
+#ifdef SPECULAR
+#ifdef FIXED_RASTER
+    const Vec3 worldPos = Vec3(FixedAttribute(a.values[6], p), FixedAttribute(a.values[7], p), FixedAttribute(a.values[8], p));
+#else
+    Vec3 worldPos;
+    for (int k = 0; k < 3; k++)
+    {
+        worldPos = worldPos + a.spos[k] * p.w[k];
+    }
+    worldPos = worldPos * p.depth;
+#endif
+    color = lighting.Shade(color, normal, cameraPos - worldPos);
+#else
+    color = lighting.Shade(color, normal, cameraPos);
+#endif
+    const f32 channelMax[3] = { redMax, greenMax, blueMax };
+    for (int i = 0; i < 3; i++)
+    {
+        if (color[i] < 0) color[i] = 0;
+        if (color[i] > channelMax[i]) color[i] = channelMax[i];
+    }
+    return PackChannels((u32)(color.x + threshold), (u32)(color.y + threshold), (u32)(color.z + threshold));
+}
+
+bool Rasterizer::Init(const char* path, const char* skyboxPath, IVec2 res, u32 threads)
+{
+    ModelData data = ModelLoader::ParseModelFile(path, skyboxPath);
+    file = data.file;
+    mesh = data.mesh;
+    triCount = mesh.indexCount / 3;
+    // the loader already told why the model is missing
+    if (mesh.clusterCount == 0) return false;
+    // textures converted with the model are ready to sample, png ones are prepared here
+    if (data.texLevels)
+    {
+        texture = Texture::FromLevels(data.tex, data.tRes, data.texLevels);
+    }
+    else
+    {
+        texture = Texture(data.tex, data.tRes);
+#ifdef TEX_ALPHA
+        texture.Prepare(true, true);
+#else
+        texture.Prepare(true, false);
+#endif
+    }
     skybox = Texture(data.sky, data.sRes);
+    skybox.Prepare(false, false);
+    lighting.Init(data.material);
+
+    tileCount = IVec2((res.x + TILE_SIZE - 1) / TILE_SIZE, (res.y + TILE_SIZE - 1) / TILE_SIZE);
+    setups = (TriangleSetup*)(malloc(triCount * sizeof(TriangleSetup)));
+#ifdef SPECULAR
+    const u32 attributes = 11;
+#else
+    const u32 attributes = 8;
+#endif
+    f32* block = (f32*)(malloc(mesh.vertexCount * attributes * sizeof(f32)));
+    f32** arrays[] = { &projected.x, &projected.y, &projected.z, &projected.nx, &projected.ny, &projected.nz, &projected.u, &projected.v,
+#ifdef SPECULAR
+        &projected.wx, &projected.wy, &projected.wz
+#endif
+    };
+    for (u32 i = 0; i < attributes; i++)
+    {
+        *arrays[i] = block + i * mesh.vertexCount;
+    }
+    visibleClusters = (u32*)(malloc(mesh.clusterCount * sizeof(u32)));
+    drawOrder = (u32*)(malloc(triCount * sizeof(u32)));
+#ifdef SORT_TRIANGLES
+    sortScratch = (u32*)(malloc(triCount * sizeof(u32)));
+#endif
+    binStart = (u32*)(malloc((tileCount.x * tileCount.y + 1) * sizeof(u32)));
+    binCapacity = triCount * 2;
+    binTris = (u32*)(malloc(binCapacity * sizeof(u32)));
+    workers.Init(threads);
+    tiles = (Tile*)(malloc(workers.GetWorkerCount() * sizeof(Tile)));
+    if (setups == NULL || block == NULL || visibleClusters == NULL || drawOrder == NULL || binStart == NULL || binTris == NULL || tiles == NULL
+#ifdef SORT_TRIANGLES
+        || sortScratch == NULL
+#endif
+        )
+    {
+        printf("Error - failed to allocate triangle bins\nOut of memory?\n");
+        return false;
+    }
+    ready = true;
+    return true;
 }
 
 Rasterizer::~Rasterizer()
 {
-    if (tris != NULL)
+    if (mesh.x != NULL)
     {
-        free(tris);
-        tris = NULL;
+        mesh.Destroy();
         texture.Destroy();
         skybox.Destroy();
     }
+    file.Close();
+    workers.Destroy();
+    free(projected.x);
+    projected = ProjectedVertices();
+    free(setups);
+    free(visibleClusters);
+    free(drawOrder);
+#ifdef SORT_TRIANGLES
+    free(sortScratch);
+    sortScratch = NULL;
+#endif
+    free(binStart);
+    free(binTris);
+    free(tiles);
+    setups = NULL;
+    visibleClusters = NULL;
+    drawOrder = NULL;
+    binStart = NULL;
+    binTris = NULL;
+    tiles = NULL;
 }
 
-void Rasterizer::DrawSkybox(RenderThread* th, const Mat4& v)
+void Rasterizer::DrawSkybox(RenderThread* th, s32 startY, s32 endY)
 {
     const IVec2 res = th->getResolution();
-    const Vec2 half = Vec2(res.x / 2, res.y / 2);
-    const Vec2 hRes = Vec2(1.0f / half.x, 1.0f / half.y);
-    const Vec3 dx = (v * Vec4(hRes.x, 0, 0, 0)).GetVector();
-    const Vec3 dy = (v * Vec4(0, -hRes.y, 0, 0)).GetVector();
-    const Vec3 dz = (v * Vec4(0, 0, -1, 0)).GetVector();
-    for (u32 y = 0; y < (u32)(res.y); y++)
+    Pixel row[SIZEX];
+    for (s32 y = startY; y < endY; y++)
     {
-        for (u32 x = 0; x < (u32)(res.x); x++)
-        {
-            Vec2 uv = Vec2((f32)(x), (f32)(y)) - half;
-            Vec3 dir = (dx * uv.x + dy * uv.y + dz);
-            u32 color = skybox.SampleCubeRaw(Vec3(dir.x, dir.y, dir.z));
-            u32 c = ((color & 0xff) << 16) | (color & 0xff00) | ((color & 0xff0000) >> 16);
-            th->SetColor(x, y, c);
-        }
+        // directions are linear in the pixel position, each pixel of the row is one step further than the previous one
+        skybox.SampleCubeSpan(skyOrigin + skyStepY * (f32)(y), skyStepX, res.x, row);
+        th->SetPixels(0, y, row, res.x);
     }
 }
 
@@ -61,137 +369,578 @@ void Rasterizer::DrawScreen(RenderThread* th, f32 dt)
     //tm2 = sinf(tm2) * 0.4f;
     Mat4 m = Mat4::CreateTransformMatrix(Vec3(0, 0, 0), Vec3(0, 0, 0));
     tm *= 2.0f;
-    const Vec3 cameraPos = Vec3(sin(tm) * 7, sin(tm * 0.846876f) * 2.0f, cos(tm) * 7);
+    cameraPos = Vec3(sin(tm) * 7, sin(tm * 0.846876f) * 2.0f, cos(tm) * 7);
     Mat4 v = Mat4::CreateViewMatrix(cameraPos, Vec3(0, 0, 0), Vec3(0, 1, 0));
+    target = th;
+    model = m;
+    modelView = v * m;
+    // without its buffers nothing can be drawn, the frame keeps its clear color
+    if (!ready)
+    {
+        drawnBounds = Rect();
+        return;
+    }
     if (skybox.IsValid())
     {
-        DrawSkybox(th, v.FastInverse());
+        const IVec2 res = th->getResolution();
+        const Vec2 half = Vec2(res.x / 2, res.y / 2);
+        const Mat4 skyView = v.FastInverse();
+        skyStepX = (skyView * Vec4(1.0f / half.x, 0, 0, 0)).GetVector();
+        skyStepY = (skyView * Vec4(0, -1.0f / half.y, 0, 0)).GetVector();
+        skyOrigin = (skyView * Vec4(0, 0, -1, 0)).GetVector() - skyStepX * half.x - skyStepY * half.y;
+#ifndef SKYBOX_LAST
+        workers.Run(SkyboxTask, this, tileCount.y);
+#endif
     }
-    Mat4 mv = v * m;
-    const IVec2 res = th->getResolution();
-    const IVec2 hRes = IVec2(res.x/2, res.y/2);
 
-    //std::copy(content, content + 16, &m.content->value);
-    // screen render
-    for (u32 t = 0; t < triCount; ++t)
+    // front-end: drop the clusters out of view or facing away, transform the vertices of the others once,
+    // set up their triangles, then sort them into screen tiles. Each worker task handles one cluster.
+    CullClusters();
+    workers.Run(VertexTask, this, visibleClusterCount);
+    workers.Run(SetupTask, this, visibleClusterCount);
+    BinTriangles();
+
+    // back-end: rasterize tile by tile with color and depth kept in the tile scratch of each worker.
+    // The frame is not cleared beforehand, every tile is either drawn from the clear values or cleared.
+    workers.Run(TileTask, this, tileCount.x * tileCount.y);
+}
+
+void Rasterizer::SkyboxTask(void* data, u32, u32 task)
+{
+    Rasterizer* r = static_cast<Rasterizer*>(data);
+    const s32 height = r->target->getResolution().y;
+    r->DrawSkybox(r->target, task * TILE_SIZE, Util::MinI((task + 1) * TILE_SIZE, height));
+}
+
+void Rasterizer::VertexTask(void* data, u32, u32 task)
+{
+    Rasterizer* r = static_cast<Rasterizer*>(data);
+    const Cluster& c = r->mesh.clusters[r->visibleClusters[task]];
+    r->TransformVertices(c.firstVertex, c.firstVertex + c.vertexCount);
+}
+
+void Rasterizer::SetupTask(void* data, u32, u32 task)
+{
+    Rasterizer* r = static_cast<Rasterizer*>(data);
+    const Cluster& c = r->mesh.clusters[r->visibleClusters[task]];
+    r->SetupTriangles(c.firstTriangle, c.firstTriangle + c.triangleCount);
+}
+
+void Rasterizer::TileTask(void* data, u32 worker, u32 task)
+{
+    Rasterizer* r = static_cast<Rasterizer*>(data);
+    const IVec2 res = r->target->getResolution();
+    Tile& tile = r->tiles[worker];
+    tile.x = (task % r->tileCount.x) * TILE_SIZE;
+    tile.y = (task / r->tileCount.x) * TILE_SIZE;
+    tile.w = Util::MinI(TILE_SIZE, res.x - tile.x);
+    tile.h = Util::MinI(TILE_SIZE, res.y - tile.y);
+    if (r->binStart[task] == r->binStart[task + 1])
+    {
+        if (!r->skybox.IsValid())
+        {
+            r->target->ClearTile(tile);
+            return;
+        }
+#ifdef SKYBOX_LAST
+        // only the skybox is visible
+        for (s32 y = 0; y < tile.h; y++)
+        {
+            tile.coverage[y] = 0;
+        }
+        r->DrawSkyboxTile(tile);
+        for (s32 y = 0; y < tile.h; y++)
+        {
+            r->target->SetPixels(tile.x, tile.y + y, tile.color + y * TILE_SIZE, tile.w);
+        }
+#endif
+        return;
+    }
+    r->target->LoadTile(tile);
+    r->DrawTile(tile, task);
+#ifdef SKYBOX_LAST
+    if (r->skybox.IsValid()) r->DrawSkyboxTile(tile);
+#endif
+    r->target->StoreTile(tile);
+}
+
+void Rasterizer::CullClusters()
+{
+    const IVec2 res = target->getResolution();
+    // slopes of the side planes of the frustum, as projected by TransformVertices
+    const f32 slopeX = 0.5f * res.x / res.y;
+    const f32 slopeY = 0.5f;
+    const f32 scaleX = 1 / sqrtf(1 + slopeX * slopeX);
+    const f32 scaleY = 1 / sqrtf(1 + slopeY * slopeY);
+    visibleClusterCount = 0;
+    for (u32 k = 0; k < mesh.clusterCount; k++)
     {
-        Vec3 points[3];
-        Vec3 normals[3];
-        Vec2 uvs[3];
+        const Cluster& c = mesh.clusters[k];
+        // the model transform is rigid, so the bounds keep their size in view space where the camera is the origin
+        const Vec3 center = (modelView * Vec4(c.center, 1)).GetVector();
+        const f32 r = c.radius;
+        // pixels closer than 1 unit are discarded, which makes z = -1 the near plane
+        if (center.z - r > -1) continue;
+        if ((center.x + slopeX * center.z) * scaleX > r || (slopeX * center.z - center.x) * scaleX > r) continue;
+        if ((center.y + slopeY * center.z) * scaleY > r || (slopeY * center.z - center.y) * scaleY > r) continue;
+        const Vec3 axis = (modelView * Vec4(c.coneAxis, 0)).GetVector();
+        if (center.Dot(axis) >= c.coneCutoff * center.Length() + r) continue;
+        visibleClusters[visibleClusterCount++] = k;
+    }
+}
+
+void Rasterizer::TransformVertices(u32 start, u32 end)
+{
+    const IVec2 res = target->getResolution();
+    const IVec2 hRes = IVec2(res.x/2, res.y/2);
+    const u32 count = end - start;
+    ProjectedVertices& o = projected;
+    // view space positions land in the output arrays and are projected in place
+    modelView.TransformPoints(mesh.x + start, mesh.y + start, mesh.z + start, o.x + start, o.y + start, o.z + start, count);
+    model.TransformDirections(mesh.nx + start, mesh.ny + start, mesh.nz + start, o.nx + start, o.ny + start, o.nz + start, count);
 #ifdef SPECULAR
-        Vec3 spos[3];
+    model.TransformPoints(mesh.x + start, mesh.y + start, mesh.z + start, o.wx + start, o.wy + start, o.wz + start, count);
 #endif
-        for (int k = 0; k < 3; k++)
-        {
-            Vertex& d = tris[t].data[k];
-            points[k] = (mv * Vec4(d.pos, 1)).GetVector();
-            points[k].z = 1 / points[k].z;
-            points[k].x = 2 * points[k].x * -points[k].z * hRes.y + hRes.x;
-            points[k].y = 2 * points[k].y * points[k].z * hRes.y + hRes.y;
-            normals[k] = (m * Vec4(d.norm, 0)).GetVector() * points[k].z;
-            uvs[k] = d.uv * points[k].z;
+    for (u32 i = start; i < end; ++i)
+    {
+        const f32 z = 1 / o.z[i];
+        o.x[i] = 2 * o.x[i] * -z * hRes.y + hRes.x;
+        o.y[i] = 2 * o.y[i] * z * hRes.y + hRes.y;
+        o.z[i] = z;
+        o.nx[i] *= z;
+        o.ny[i] *= z;
+        o.nz[i] *= z;
+        o.u[i] = mesh.u[i] * z;
+        o.v[i] = mesh.v[i] * z;
 #ifdef SPECULAR
-            spos[k] = (m * Vec4(d.pos, 1)).GetVector() * points[k].z;
+        o.wx[i] *= z;
+        o.wy[i] *= z;
+        o.wz[i] *= z;
 #endif
+    }
+}
+
+void Rasterizer::SetupTriangles(u32 start, u32 end)
+{
+    const IVec2 res = target->getResolution();
+    const ProjectedVertices& o = projected;
+    for (u32 t = start; t < end; ++t)
+    {
+        TriangleSetup& s = setups[t];
+        s.visible = false;
+        for (int k = 0; k < 3; k++)
+        {
+            s.indices[k] = mesh.GetIndex(t * 3 + k);
         }
 
-        f32 area = EdgeFunction(Vec2(points[0].x, points[0].y), Vec2(points[1].x, points[1].y), Vec2(points[2].x, points[2].y));
-        if (area < 0) continue;
-        area = 1 / area;
+        // pixels are only kept for -1 <= 1 / z < 0, which bounds the depths the triangle can reach
+        const f32 z0 = o.z[s.indices[0]];
+        const f32 z1 = o.z[s.indices[1]];
+        const f32 z2 = o.z[s.indices[2]];
+        const f32 nearInv = Util::MaxF(Util::MinF(Util::MinF(z0, z1), z2), -1.0f);
+        const f32 farInv = Util::MaxF(Util::MaxF(z0, z1), z2);
+        if (!(nearInv < 0)) continue;
+        s.nearDepth = 1 / nearInv;
+        s.farDepth = farInv < 0 ? 1 / farInv : -INFINITY;
+        s.depthKey = (u16)((nearInv + 1.0f) * 65535.0f);
 
-        s32 minY = (s32)(Util::MinF(Util::MinF(points[0].y, points[1].y), points[2].y));
-        s32 maxY = (s32)(Util::MaxF(Util::MaxF(points[0].y, points[1].y), points[2].y));
-        s32 minX = (s32)(Util::MinF(Util::MinF(points[0].x, points[1].x), points[2].x));
-        s32 maxX = (s32)(Util::MaxF(Util::MaxF(points[0].x, points[1].x), points[2].x));
+#ifdef FIXED_RASTER
+        // snap the vertices to the sub-pixel grid, everything after this is exact integer math
+        s64 px[3];
+        s64 py[3];
+        bool outside = false;
+        for (int k = 0; k < 3; k++)
+        {
+            const u32 index = s.indices[k];
+            // written so that NaN coordinates fail the test as well
+            if (!(fabsf(o.x[index]) < guardBand && fabsf(o.y[index]) < guardBand && fabsf(o.z[index]) < maxInvDepth)) outside = true;
+            px[k] = (s64)(floorf(o.x[index] * subPixels + 0.5f));
+            py[k] = (s64)(floorf(o.y[index] * subPixels + 0.5f));
+        }
+        if (outside) continue;
+
+        const s64 area = (px[0] - px[1]) * (py[2] - py[1]) - (py[0] - py[1]) * (px[2] - px[1]);
+        if (area <= 0) continue;
+        s.area = ((s64)1 << 60) / area;
+        s.mipLevel = SelectMipLevel(s, (f32)(area) / (subPixels * subPixels));
 
-        Vec3 A;
-        Vec3 B;
-        Vec3 row;
-        Vec2 pos = Vec2(minX + 0.5f, minY + 0.5f);
+        // the guard band keeps the snapped coordinates within 24 bits
+        s.minX = Util::MinI(Util::MinI((s32)px[0], (s32)px[1]), (s32)px[2]) >> SUBPIXEL_BITS;
+        s.maxX = Util::MaxI(Util::MaxI((s32)px[0], (s32)px[1]), (s32)px[2]) >> SUBPIXEL_BITS;
+        s.minY = Util::MinI(Util::MinI((s32)py[0], (s32)py[1]), (s32)py[2]) >> SUBPIXEL_BITS;
+        s.maxY = Util::MaxI(Util::MaxI((s32)py[0], (s32)py[1]), (s32)py[2]) >> SUBPIXEL_BITS;
+        if (s.maxX < 0 || s.maxY < 0 || s.minX >= res.x || s.minY >= res.y) continue;
+
+        const s64 originX = (s64)s.minX * subPixels + subPixels / 2;
+        const s64 originY = (s64)s.minY * subPixels + subPixels / 2;
+        s.topLeft = 0;
         for (int i = 0; i < 3; i++)
         {
-            A[i] = (points[(i + 1) % 3].y - points[(i + 2) % 3].y);
-            B[i] = (points[(i + 2) % 3].x - points[(i + 1) % 3].x);
-            row[i] = EdgeFunction(pos, Vec2(points[(i + 1) % 3].x, points[(i + 1) % 3].y), Vec2(points[(i + 2) % 3].x, points[(i + 2) % 3].y));
+            const int a = (i + 1) % 3;
+            const int b = (i + 2) % 3;
+            const s64 dx = px[b] - px[a];
+            const s64 dy = py[b] - py[a];
+            s.edgeA[i] = -dy * subPixels;
+            s.edgeB[i] = dx * subPixels;
+            s.edgeC[i] = (originX - px[a]) * dy - (originY - py[a]) * dx;
+            // pixels exactly on the other edges are pushed out by one unit, coverage is then a plain sign test
+            if (dy > 0 || (dy == 0 && dx < 0)) s.topLeft |= 1 << i;
+            else s.edgeC[i] -= 1;
+        }
+#else
+        Vec2 points[3];
+        for (int k = 0; k < 3; k++)
+        {
+            points[k] = Vec2(o.x[s.indices[k]], o.y[s.indices[k]]);
         }
-        for (s32 y = minY; y <= maxY; y++)
+
+        f32 area = EdgeFunction(points[0], points[1], points[2]);
+        if (area <= 0) continue;
+        s.area = 1 / area;
+        s.mipLevel = SelectMipLevel(s, area);
+
+        s.minY = (s32)(Util::MinF(Util::MinF(points[0].y, points[1].y), points[2].y));
+        s.maxY = (s32)(Util::MaxF(Util::MaxF(points[0].y, points[1].y), points[2].y));
+        s.minX = (s32)(Util::MinF(Util::MinF(points[0].x, points[1].x), points[2].x));
+        s.maxX = (s32)(Util::MaxF(Util::MaxF(points[0].x, points[1].x), points[2].x));
+        if (s.maxX < 0 || s.maxY < 0 || s.minX >= res.x || s.minY >= res.y) continue;
+
+        const Vec2 origin = Vec2(s.minX + 0.5f, s.minY + 0.5f);
+        s.topLeft = 0;
+        for (int i = 0; i < 3; i++)
         {
-            //assert(y < res.y && y >= 0);
-            if (y < 0 || y >= res.y) continue;
-            bool inside = false;
-            for (s32 x = minX; x <= maxX; x++)
+            const Vec2& a = points[(i + 1) % 3];
+            const Vec2& b = points[(i + 2) % 3];
+            s.edgeA[i] = a.y - b.y;
+            s.edgeB[i] = b.x - a.x;
+            s.edgeC[i] = EdgeFunction(origin, a, b);
+            // the edge value grows towards +x on left edges, and towards +y on horizontal top edges
+            if (s.edgeA[i] < 0 || (s.edgeA[i] == 0 && s.edgeB[i] < 0)) s.topLeft |= 1 << i;
+        }
+#endif
+        s.visible = true;
+    }
+}
+
+// Picks the level from the ratio between the uv and screen areas of the triangle,
+// which is exact for affine mappings and close enough for the small triangles of the models
+u8 Rasterizer::SelectMipLevel(const TriangleSetup& s, f32 screenArea) const
+{
+    if (texture.GetMipCount() <= 1) return 0;
+    const u32 i0 = s.indices[0];
+    const u32 i1 = s.indices[1];
+    const u32 i2 = s.indices[2];
+    const f32 uvArea = (mesh.u[i1] - mesh.u[i0]) * (mesh.v[i2] - mesh.v[i0]) - (mesh.v[i1] - mesh.v[i0]) * (mesh.u[i2] - mesh.u[i0]);
+    return (u8)(texture.GetMipLevel(fabsf(uvArea) / screenArea));
+}
+
+#ifdef SORT_TRIANGLES
+void Rasterizer::SortTriangles(u32 count)
+{
+    // LSD radix sort of the 16 bit depth keys in two byte passes, ending back in drawOrder.
+    // It is stable, so triangles at the same depth keep their file order.
+    u32* src = drawOrder;
+    u32* dst = sortScratch;
+    for (u32 shift = 0; shift < 16; shift += 8)
+    {
+        u32 offsets[256] = { 0 };
+        for (u32 i = 0; i < count; i++)
+        {
+            offsets[(setups[src[i]].depthKey >> shift) & 0xff]++;
+        }
+        u32 sum = 0;
+        for (u32 i = 0; i < 256; i++)
+        {
+            const u32 c = offsets[i];
+            offsets[i] = sum;
+            sum += c;
+        }
+        for (u32 i = 0; i < count; i++)
+        {
+            dst[offsets[(setups[src[i]].depthKey >> shift) & 0xff]++] = src[i];
+        }
+        u32* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+}
+#endif
+
+void Rasterizer::BinTriangles()
+{
+    const IVec2 res = target->getResolution();
+    const s32 tiles = tileCount.x * tileCount.y;
+    for (s32 i = 0; i <= tiles; i++)
+    {
+        binStart[i] = 0;
+    }
+    drawnBounds = Rect();
+
+    // first pass counts the triangles of each tile, the prefix sum then gives where each bin ends
+    u32 count = 0;
+    for (u32 k = 0; k < visibleClusterCount; k++)
+    {
+        const Cluster& c = mesh.clusters[visibleClusters[k]];
+        for (u32 t = c.firstTriangle; t < c.firstTriangle + c.triangleCount; t++)
+        {
+            const TriangleSetup& s = setups[t];
+            if (!s.visible) continue;
+            drawOrder[count++] = t;
+            drawnBounds = drawnBounds.Union(Rect(Util::MaxI(s.minX, 0), Util::MaxI(s.minY, 0), Util::MinI(s.maxX, res.x - 1), Util::MinI(s.maxY, res.y - 1)));
+            s32 tx0 = Util::MaxI(s.minX, 0) / TILE_SIZE;
+            s32 ty0 = Util::MaxI(s.minY, 0) / TILE_SIZE;
+            s32 tx1 = Util::MinI(s.maxX / TILE_SIZE, tileCount.x - 1);
+            s32 ty1 = Util::MinI(s.maxY / TILE_SIZE, tileCount.y - 1);
+            for (s32 ty = ty0; ty <= ty1; ty++)
             {
-                //assert(x < res.x && x >= 0);
-                if (x < 0 || x >= res.x) continue;
-                //assert(pIndex >= 0 && pIndex < SIZEX * SIZEY);
-                //if (pIndex < 0 || pIndex >= pixelCount) continue;
-                Vec3 w = row - B * (f32)(y - minY) - A * (f32)(x - minX);
-                //assert(pIndex >= 0 && pIndex < pixelCount);
-                if (w[0] < 0 || w[1] < 0 || w[2] < 0)
+                for (s32 tx = tx0; tx <= tx1; tx++)
                 {
-                    if (inside) break;
-                    continue;
+                    binStart[ty * tileCount.x + tx + 1]++;
                 }
-                inside = true;
-                w = w * area;
-                f32 depth = 0;
-#ifdef SPECULAR
-                Vec3 worldPos;
+            }
+        }
+    }
+    for (s32 i = 0; i < tiles; i++)
+    {
+        binStart[i + 1] += binStart[i];
+    }
+
+    const u32 total = binStart[tiles];
+    if (total > binCapacity)
+    {
+        u32* tmp = (u32*)(realloc(binTris, total * sizeof(u32)));
+        if (tmp == NULL)
+        {
+            printf("Error - failed to allocate %zu bytes for triangle bins\nOut of memory?", total * sizeof(u32));
+            // nothing gets drawn, the tiles are still cleared
+            for (s32 i = 0; i <= tiles; i++)
+            {
+                binStart[i] = 0;
+            }
+            drawnBounds = Rect();
+            return;
+        }
+        binTris = tmp;
+        binCapacity = total;
+    }
+
+#ifdef SORT_TRIANGLES
+    SortTriangles(count);
 #endif
-                Vec3 normal;
-                Vec2 uv;
-                for (int k = 0; k < 3; k++)
-                {
-                    depth += w[k] * points[k].z;
-#ifdef SPECULAR
-                    worldPos = worldPos + spos[k] * w[k];
+
+    // second pass fills the bins in draw order, shifting each start back into place
+    for (u32 i = 0; i < count; i++)
+    {
+        const u32 t = drawOrder[i];
+        const TriangleSetup& s = setups[t];
+        s32 tx0 = Util::MaxI(s.minX, 0) / TILE_SIZE;
+        s32 ty0 = Util::MaxI(s.minY, 0) / TILE_SIZE;
+        s32 tx1 = Util::MinI(s.maxX / TILE_SIZE, tileCount.x - 1);
+        s32 ty1 = Util::MinI(s.maxY / TILE_SIZE, tileCount.y - 1);
+        for (s32 ty = ty0; ty <= ty1; ty++)
+        {
+            for (s32 tx = tx0; tx <= tx1; tx++)
+            {
+                binTris[binStart[ty * tileCount.x + tx]++] = t;
+            }
+        }
+    }
+    for (s32 i = tiles; i > 0; i--)
+    {
+        binStart[i] = binStart[i - 1];
+    }
+    binStart[0] = 0;
+}
+
+void Rasterizer::DrawTile(Tile& tile, u32 index)
+{
+#ifdef SKYBOX_LAST
+    for (s32 i = 0; i < tile.h; i++)
+    {
+        tile.coverage[i] = 0;
+    }
 #endif
-                    normal = normal + normals[k] * w[k];
-                    uv = uv + uvs[k] * w[k];
-                }
-                //if (depth == 0) depth = FP32(0.0001f);
-                if (depth < -1.0f || depth >= 0.0f) continue;
-                depth = 1 / depth;
-                s32 pIndex = y * res.x + x;
-#ifndef TEX_ALPHA
-                if (depth < th->GetDepth(pIndex)) continue;
-
-                th->SetDepth(pIndex, depth);
-                uv = uv * depth;
-                Vec3 color = texture.Sample(uv).GetVector(); // +FVec3(deltaB, deltaB, deltaB);
-#else
-                uv = uv * depth;
-                Vec4 colortmp = texture.Sample(uv);
-                if (depth < th->GetDepth(pIndex) || colortmp.w < 0.5f) continue;
-                th->SetDepth(pIndex, depth);
-                Vec3 color = colortmp.GetVector();
-#endif
-                normal = (normal * depth).Normalize();
-                f32 deltaA = (lightDir.Dot(normal));
-                deltaA *= 0.75f;
-                deltaA += 0.25f;
-                if (deltaA < 0.1f) deltaA = 0.1f;
-                color = color * deltaA;
-#ifdef SPECULAR
-                worldPos = worldPos * depth;
-                const Vec3 view = (cameraPos - worldPos).Normalize();
-                Vec3 halfV = (lightDir + view).Normalize();
-                //FP32 deltaB = FP32(powf(FMax(normal.Dot(halfV), 0).ToFloat(), 64.0f) * 255.0f);
-                f32 deltaB = powf(Util::MaxF(normal.Dot(halfV), 0), 64.0f);
-                deltaB *= 255;
-                color = color + Vec3(deltaB, deltaB, deltaB);
-#endif
-                //depth = depth * FP32((s32)-32);
-                //color = FVec3(depth, depth, depth);
-                
-                for (int i = 0; i < 3; i++)
+#ifdef DEFERRED_SHADING
+    for (s32 i = 0; i < tile.h * TILE_SIZE; i++)
+    {
+        tile.triangles[i] = noTriangle;
+    }
+#endif
+    for (u32 i = binStart[index]; i < binStart[index + 1]; i++)
+    {
+        const TriangleSetup& s = setups[binTris[i]];
+        // hidden behind everything already drawn in the tile
+        if (s.nearDepth < tile.minDepth) continue;
+        RasterizeTriangle(tile, s, binTris[i]);
+    }
+#ifdef DEFERRED_SHADING
+    ShadeTile(tile);
+#endif
+}
+
+void Rasterizer::RasterizeTriangle(Tile& tile, const TriangleSetup& s, u32 index)
+{
+    TriangleAttributes a;
+    a.Load(projected, s);
+    const s32 startX = Util::MaxI(s.minX, tile.x);
+    const s32 startY = Util::MaxI(s.minY, tile.y);
+    const s32 endX = Util::MinI(s.maxX, tile.x + tile.w - 1);
+    const s32 endY = Util::MinI(s.maxY, tile.y + tile.h - 1);
+    const EdgeValue* A = s.edgeA;
+    const EdgeValue* B = s.edgeB;
+
+    // walk the blocks of the tile overlapped by the bounding box
+    const s32 firstX = tile.x + (startX - tile.x) / BLOCK_SIZE * BLOCK_SIZE;
+    const s32 firstY = tile.y + (startY - tile.y) / BLOCK_SIZE * BLOCK_SIZE;
+    bool raised = false;
+    for (s32 by = firstY; by <= endY; by += BLOCK_SIZE)
+    {
+        const s32 y0 = Util::MaxI(by, startY);
+        const s32 y1 = Util::MinI(by + BLOCK_SIZE - 1, endY);
+        for (s32 bx = firstX; bx <= endX; bx += BLOCK_SIZE)
+        {
+            const s32 block = (by - tile.y) / BLOCK_SIZE * TILE_BLOCKS + (bx - tile.x) / BLOCK_SIZE;
+            if (s.nearDepth < tile.blockMin[block]) continue;
+            const s32 x0 = Util::MaxI(bx, startX);
+            const s32 x1 = Util::MinI(bx + BLOCK_SIZE - 1, endX);
+
+            // edges are linear, so their extremes over the block are found at its corners
+            EdgeValue corner[3];
+            bool empty = false;
+            bool full = true;
+            for (int i = 0; i < 3; i++)
+            {
+                corner[i] = s.edgeC[i] - A[i] * (EdgeValue)(x0 - s.minX) - B[i] * (EdgeValue)(y0 - s.minY);
+                const EdgeValue stepX = -A[i] * (EdgeValue)(x1 - x0);
+                const EdgeValue stepY = -B[i] * (EdgeValue)(y1 - y0);
+                const EdgeValue low = corner[i] + (stepX < 0 ? stepX : 0) + (stepY < 0 ? stepY : 0);
+                const EdgeValue high = corner[i] + (stepX > 0 ? stepX : 0) + (stepY > 0 ? stepY : 0);
+                if (!EdgeInside(high, s.topLeft, i)) empty = true;
+                if (!EdgeInside(low, s.topLeft, i)) full = false;
+            }
+            if (empty) continue;
+
+            // the per pixel depth test can be skipped when the block only holds further pixels
+            const bool testDepth = s.farDepth <= tile.blockMax[block];
+            bool written = false;
+            s32 settled = 0;
+            for (s32 y = y0; y <= y1; y++)
+            {
+                EdgeValue w0 = corner[0];
+                EdgeValue w1 = corner[1];
+                EdgeValue w2 = corner[2];
+                corner[0] -= B[0];
+                corner[1] -= B[1];
+                corner[2] -= B[2];
+                for (s32 x = x0; x <= x1; x++, w0 -= A[0], w1 -= A[1], w2 -= A[2])
                 {
-                    if (color[i] < 0) color[i] = 0;
-                    if (color[i] > 255) color[i] = 255;
+                    if (!full && !(EdgeInside(w0, s.topLeft, 0) && EdgeInside(w1, s.topLeft, 1) && EdgeInside(w2, s.topLeft, 2))) continue;
+                    PixelWeights p;
+                    if (!PixelDepth(s, a, w0, w1, w2, p)) continue;
+                    s32 pIndex = (y - tile.y) * TILE_SIZE + (x - tile.x);
+                    if (testDepth && p.depth < tile.depth[pIndex])
+                    {
+                        settled++;
+                        continue;
+                    }
+#if !defined(DEFERRED_SHADING) || defined(TEX_ALPHA)
+                    const Texel texel = SampleTexel(texture, PixelUV(a, p), s.mipLevel);
+#ifdef TEX_ALPHA
+                    if (!TexelVisible(texel)) continue;
+#endif
+#endif
+                    tile.depth[pIndex] = p.depth;
+#ifdef SKYBOX_LAST
+                    tile.coverage[y - tile.y] |= 1u << (x - tile.x);
+#endif
+                    written = true;
+                    settled++;
+#ifdef DEFERRED_SHADING
+                    tile.triangles[pIndex] = index;
+#ifdef TEX_ALPHA
+                    tile.texels[pIndex] = texel;
+#endif
+#else
+                    tile.color[pIndex] = ShadePixel(a, p, TexelColor(texel), lighting, cameraPos, DitherThreshold(x, y));
+#endif
                 }
-                u32 c = ((u32)color.x << 16) | ((u32)(color.y) << 8) | (u32)(color.z);
-                th->SetColor(x, y, c);
             }
+
+            if (written) tile.blockMax[block] = Util::MaxF(tile.blockMax[block], s.nearDepth);
+            // once every pixel of the block holds this triangle or something closer, nothing in it is further than farDepth
+            const bool wholeBlock = x0 == bx && y0 == by && x1 == Util::MinI(bx + BLOCK_SIZE, tile.x + tile.w) - 1 && y1 == Util::MinI(by + BLOCK_SIZE, tile.y + tile.h) - 1;
+            if (full && wholeBlock && settled == (x1 - x0 + 1) * (y1 - y0 + 1) && s.farDepth > tile.blockMin[block])
+            {
+                tile.blockMin[block] = s.farDepth;
+                raised = true;
+            }
+        }
+    }
+#ifndef DEFERRED_SHADING
+    (void)index;
+#endif
+
+    if (raised)
+    {
+        tile.minDepth = INFINITY;
+        for (s32 i = 0; i < TILE_BLOCKS * TILE_BLOCKS; i++)
+        {
+            tile.minDepth = Util::MinF(tile.minDepth, tile.blockMin[i]);
+        }
+    }
+}
+
+#ifdef DEFERRED_SHADING
+void Rasterizer::ShadeTile(Tile& tile)
+{
+    TriangleAttributes a;
+    u32 loaded = noTriangle;
+    for (s32 y = 0; y < tile.h; y++)
+    {
+        for (s32 x = 0; x < tile.w; x++)
+        {
+            const s32 pIndex = y * TILE_SIZE + x;
+            const u32 t = tile.triangles[pIndex];
+            if (t == noTriangle) continue;
+            const TriangleSetup& s = setups[t];
+            // neighbouring pixels mostly come from the same triangle
+            if (t != loaded)
+            {
+                a.Load(projected, s);
+                loaded = t;
+            }
+            const EdgeValue dx = (EdgeValue)(tile.x + x - s.minX);
+            const EdgeValue dy = (EdgeValue)(tile.y + y - s.minY);
+            PixelWeights p;
+            PixelDepth(s, a, s.edgeC[0] - s.edgeA[0] * dx - s.edgeB[0] * dy, s.edgeC[1] - s.edgeA[1] * dx - s.edgeB[1] * dy,
+                s.edgeC[2] - s.edgeA[2] * dx - s.edgeB[2] * dy, p);
+#ifdef TEX_ALPHA
+            const Texel texel = tile.texels[pIndex];
+#else
+            const Texel texel = SampleTexel(texture, PixelUV(a, p), s.mipLevel);
+#endif
+            tile.color[pIndex] = ShadePixel(a, p, TexelColor(texel), lighting, cameraPos, DitherThreshold(tile.x + x, tile.y + y));
+        }
+    }
+}
+#endif
+
+#ifdef SKYBOX_LAST
+// Fills the pixels of the tile left uncovered by the triangles, one run of consecutive pixels at a time
+void Rasterizer::DrawSkyboxTile(Tile& tile)
+{
+    const u32 rowMask = tile.w == COVERAGE_BITS ? ~0u : (1u << tile.w) - 1;
+    for (s32 y = 0; y < tile.h; y++)
+    {
+        u32 uncovered = ~tile.coverage[y] & rowMask;
+        const Vec3 rowStart = skyOrigin + skyStepX * (f32)(tile.x) + skyStepY * (f32)(tile.y + y);
+        while (uncovered)
+        {
+            const u32 start = std::countr_zero(uncovered);
+            const u32 end = start + std::countr_one(uncovered >> start);
+            skybox.SampleCubeSpan(rowStart + skyStepX * (f32)(start), skyStepX, end - start, tile.color + y * TILE_SIZE + start);
+            uncovered &= end == COVERAGE_BITS ? 0 : ~0u << end;
         }
     }
-}
\ No newline at end of file
+}
+#endif
@@ -1,6 +1,7 @@
 #include "RenderThread.hpp"
 
 #include <assert.h>
+#include <string.h>
 #include <time.h>
 
 #include "Rasterizer.hpp"
@@ -85,30 +86,66 @@ u64 GetNow()
 	return result;
 }
 
-u16 GetColorFrom24(const u32 value)
+void RenderThread::SetPixels(u32 x, u32 y, const Pixel* pixels, u32 count)
 {
-	return ((value & 0xF80000) >> 8) | ((value & 0xFC00) >> 5) | ((value & 0xF8) >> 3);
+	memcpy(colorBuffer + x + y * SIZEX, pixels, count * sizeof(Pixel));
 }
 
-void RenderThread::SetColor(u32 x, u32 y, u32 color)
+void RenderThread::LoadTile(Tile& tile)
 {
-#ifdef _WIN32
-	color = color & 0x00f8fcf8;
-	colorBuffer[x + y * SIZEX] = color;
+	// every frame redraws the whole screen, so the tile starts cleared instead of reading the frame back.
+	// Depth only lives in the tile, nothing reads it once the tile is done
+#ifdef SKYBOX_LAST
+	const bool readColor = false;
 #else
-
-	colorBuffer[x + y * SIZEX] = GetColorFrom24(color);
+	const bool readColor = rasterizer.HasSkyboxLoaded();
 #endif
+	for (s32 y = 0; y < tile.h; y++)
+	{
+		const u32 src = (tile.y + y) * SIZEX + tile.x;
+		for (s32 x = 0; x < tile.w; x++)
+		{
+			tile.color[y * TILE_SIZE + x] = readColor ? colorBuffer[src + x] : 0;
+			tile.depth[y * TILE_SIZE + x] = -INFINITY;
+		}
+	}
+	// blocks outside of the screen keep empty bounds so they never hold the tile minimum back
+	for (s32 y = 0; y < TILE_BLOCKS; y++)
+	{
+		for (s32 x = 0; x < TILE_BLOCKS; x++)
+		{
+			const bool inside = x * BLOCK_SIZE < tile.w && y * BLOCK_SIZE < tile.h;
+			tile.blockMin[y * TILE_BLOCKS + x] = inside ? -INFINITY : INFINITY;
+			tile.blockMax[y * TILE_BLOCKS + x] = -INFINITY;
+		}
+	}
+	tile.minDepth = -INFINITY;
 }
 
-float RenderThread::GetDepth(u32 i)
+void RenderThread::StoreTile(const Tile& tile)
 {
-	return depthBuffer[i];
+	for (s32 y = 0; y < tile.h; y++)
+	{
+		const u32 dst = (tile.y + y) * SIZEX + tile.x;
+		for (s32 x = 0; x < tile.w; x++)
+		{
+			colorBuffer[dst + x] = tile.color[y * TILE_SIZE + x];
+		}
+	}
 }
 
-void RenderThread::SetDepth(u32 i, f32 depth)
+void RenderThread::ClearTile(const Tile& tile)
 {
-	depthBuffer[i] = depth;
+	// only the part of the tile drawn by the last frame using this buffer needs to be cleared
+	const Rect area = Rect(tile.x, tile.y, tile.x + tile.w - 1, tile.y + tile.h - 1);
+	const Rect stale = area.Intersection(staleBounds);
+	for (s32 y = stale.minY; y <= stale.maxY; y++)
+	{
+		for (s32 x = stale.minX; x <= stale.maxX; x++)
+		{
+			colorBuffer[y * SIZEX + x] = 0;
+		}
+	}
 }
 
 #ifdef _WIN32
@@ -142,88 +179,203 @@ void RenderThread::CopyToScreen(HDC hdc, IVec2 res)
 
 void RenderThread::RenderFrame(HDC hdc, Maths::IVec2 res)
 {
+	if (colorBuffer == NULL) return;
 	if (static_cast<u64>(res.x) * res.y > outputBuffer.size()) outputBuffer.resize(static_cast<u64>(res.x) * res.y);
-	if (rasterizer.HasSkyboxLoaded())
-	{
-		ClearDBOnly();
-	}
-	else
-	{
-		ClearScreen();
-	}
+	staleBounds = frameBounds[0];
 	f32 iTime = GetTotalTime();
 	//Rasterizer::DrawScreen(*this, FP32(frame*0.025f));
 	rasterizer.DrawScreen(this, iTime);
+	frameBounds[0] = rasterizer.HasSkyboxLoaded() ? Rect(0, 0, resX - 1, resY - 1) : rasterizer.GetDrawnBounds();
 	CopyToScreen(hdc, res);
 }
 #else
-void RenderThread::CopyToScreen(FILE* out)
+void RenderThread::CopyToScreen(const Pixel* frame, const Rect& area, FrameOutput* out)
 {
+	// upscale straight into the mapped framebuffer when there is one
+	u16* dst = out->GetPixels();
+	u32 stride = out->GetStride();
+	if (dst == NULL)
+	{
+		dst = stagingBuffer;
+		stride = SIZEX;
+	}
+	const u32 width = out->GetWidth();
+	const u32 height = out->GetHeight();
 	const u32 factor = scaleFactor;
-	for (u32 j = 0; j < SIZEY / factor; j++)
+	const u32 startX = Util::MaxI(area.minX, 0);
+	const u32 startY = Util::MaxI(area.minY, 0);
+	const u32 endX = Util::MinI(area.maxX + 1, SIZEX / factor);
+	const u32 endY = Util::MinI(area.maxY + 1, SIZEY / factor);
+	if (startX >= endX || startY >= endY) return;
+	for (u32 j = startY; j < endY; j++)
 	{
-		for (u32 i = 0; i < SIZEX / factor; i++)
+		for (u32 i = startX; i < endX; i++)
 		{
-			u16 pixel = colorBuffer[j * SIZEX + i];
+			u16 pixel = frame[j * SIZEX + i];
 			for (u32 k = 0; k < factor; k++)
 			{
 				for (u32 l = 0; l < factor; l++)
 				{
 					u32 x = i * factor + l;
 					u32 y = j * factor + k;
-					if (x >= SIZEX || y >= SIZEY) continue;
-					stagingBuffer[y * SIZEX + x] = pixel;
+					if (x >= width || y >= height) continue;
+					dst[y * stride + x] = pixel;
 				}
 			}
 		}
 	}
-	fseek(out, 0, SEEK_SET);
-	fwrite(stagingBuffer, sizeof(unsigned short), SIZEX * SIZEY, out);
+	if (dst == stagingBuffer)
+	{
+		const u32 x = startX * factor;
+		const u32 y = startY * factor;
+		if (x >= width || y >= height) return;
+		out->Write(stagingBuffer, x, y, Util::MinI(endX * factor, width) - x, Util::MinI(endY * factor, height) - y);
+	}
 }
 
-void RenderThread::RenderFrame(FILE* out)
+void RenderThread::PresentFrame(u32 index, FrameOutput* out)
 {
-	if (rasterizer.HasSkyboxLoaded())
-	{
-		ClearDBOnly();
-	}
-	else
+	// pixels outside of both this frame and the one on screen are the clear color in both
+	const Rect& drawn = frameBounds[index];
+	CopyToScreen(frames[index], drawn.Union(screenBounds), out);
+	screenBounds = drawn;
+}
+
+void RenderThread::RenderFrame(FrameOutput* out)
+{
+	if (frameCount > 1 && !presenting) StartPresenter(out);
+	if (presenting)
 	{
-		ClearScreen();
+		// wait for the presenter to be done with the frame that last used this buffer
+		pthread_mutex_lock(&presentLock);
+		while (submitted - presented >= frameCount)
+		{
+			pthread_cond_wait(&frameFree, &presentLock);
+		}
+		pthread_mutex_unlock(&presentLock);
+		colorBuffer = frames[submitted % frameCount];
 	}
+
+	// the presenter is done with this buffer, so the bounds of its last frame are free to read
+	const u32 index = frameCount > 1 ? submitted % frameCount : 0;
+	staleBounds = frameBounds[index];
 	f32 iTime = GetTotalTime();
 	rasterizer.DrawScreen(this, iTime);
-	CopyToScreen(out);
+
+	frameBounds[index] = rasterizer.HasSkyboxLoaded() ? Rect(0, 0, resX - 1, resY - 1) : rasterizer.GetDrawnBounds();
+	if (!presenting)
+	{
+		PresentFrame(index, out);
+		return;
+	}
+	pthread_mutex_lock(&presentLock);
+	submitted++;
+	pthread_cond_signal(&frameReady);
+	pthread_mutex_unlock(&presentLock);
 }
-#endif
 
-f32 RenderThread::GetTotalTime()
+void RenderThread::FinishFrames()
 {
-	u64 now = GetNow();
-	u64 micros = now - start;
-	return micros / 1000000.0f;
+	if (!presenting) return;
+	pthread_mutex_lock(&presentLock);
+	while (presented != submitted)
+	{
+		pthread_cond_wait(&frameFree, &presentLock);
+	}
+	pthread_mutex_unlock(&presentLock);
 }
 
-void RenderThread::ClearScreen()
+void RenderThread::StartPresenter(FrameOutput* out)
 {
-	f32 min = -INFINITY;
-	for (u32 i = 0; i < SIZEX * SIZEY; i++)
+	presentOut = out;
+	submitted = 0;
+	presented = 0;
+	stopPresenter = false;
+	pthread_mutex_init(&presentLock, NULL);
+	pthread_cond_init(&frameReady, NULL);
+	pthread_cond_init(&frameFree, NULL);
+	if (pthread_create(&presenter, NULL, PresenterMain, this))
 	{
-		colorBuffer[i] = 0;
-		//colorBuffer[i] = 0x202020;
-		depthBuffer[i] = min;
+		printf("Warning - cannot start presenter thread, frames will be written synchronously\n");
+		pthread_cond_destroy(&frameFree);
+		pthread_cond_destroy(&frameReady);
+		pthread_mutex_destroy(&presentLock);
+		for (u32 i = 1; i < frameCount; i++)
+		{
+			free(frames[i]);
+			frames[i] = NULL;
+		}
+		frameCount = 1;
+		colorBuffer = frames[0];
+		return;
 	}
+	presenting = true;
 }
 
-void RenderThread::ClearDBOnly()
+void RenderThread::StopPresenter()
 {
-	f32 min = -INFINITY;
-	for (u32 i = 0; i < SIZEX * SIZEY; i++)
+	if (!presenting) return;
+	pthread_mutex_lock(&presentLock);
+	stopPresenter = true;
+	pthread_cond_signal(&frameReady);
+	pthread_mutex_unlock(&presentLock);
+	pthread_join(presenter, NULL);
+	pthread_cond_destroy(&frameFree);
+	pthread_cond_destroy(&frameReady);
+	pthread_mutex_destroy(&presentLock);
+	presenting = false;
+}
+
+void* RenderThread::PresenterMain(void* arg)
+{
+	RenderThread* th = static_cast<RenderThread*>(arg);
+	pthread_mutex_lock(&th->presentLock);
+	while (true)
 	{
-		colorBuffer[i] = 0;
-		//colorBuffer[i] = 0x202020;
-		depthBuffer[i] = min;
+		while (th->presented == th->submitted && !th->stopPresenter)
+		{
+			pthread_cond_wait(&th->frameReady, &th->presentLock);
+		}
+		// pending frames are still written out before stopping
+		if (th->presented == th->submitted) break;
+		const u32 index = th->presented % th->frameCount;
+		pthread_mutex_unlock(&th->presentLock);
+
+		th->PresentFrame(index, th->presentOut);
+
+		pthread_mutex_lock(&th->presentLock);
+		th->presented++;
+		pthread_cond_broadcast(&th->frameFree);
 	}
+	pthread_mutex_unlock(&th->presentLock);
+	return NULL;
+}
+#endif
+
+f32 RenderThread::GetTotalTime()
+{
+	u64 now = GetNow();
+	u64 micros = now - start;
+	return micros / 1000000.0f;
+}
+
+bool RenderThread::AllocateFrames(u32 count)
+{
+	if (count > MAX_FRAME_BUFFERS) count = MAX_FRAME_BUFFERS;
+	// the buffers start at the clear color, afterwards only what the frames draw gets cleared
+	for (frameCount = 0; frameCount < count; frameCount++)
+	{
+		Pixel* frame = (Pixel*)(calloc(SIZEX * SIZEY, sizeof(Pixel)));
+		if (frame == NULL)
+		{
+			printf("Error - failed to allocate %zu bytes for frame buffer\nOut of memory?\n", SIZEX * SIZEY * sizeof(Pixel));
+			break;
+		}
+		frames[frameCount] = frame;
+	}
+	// fewer buffers only mean less overlap with the presenter, but one is needed to render at all
+	colorBuffer = frames[0];
+	return frameCount > 0;
 }
 
 #ifdef _WIN32
@@ -232,6 +384,7 @@ RenderThread::RenderThread(u32 scale) :
 	resX(SIZEX / scale),
 	resY(SIZEY / scale)
 {
+	AllocateFrames(1);
 	Resources::ModelLoader::CreateModelFile("Assets/Models/spaceship_v2.obj",	"Assets/Textures/ship.png",				"Assets/Output/spaceship.bin");
 	Resources::ModelLoader::CreateModelFile("Assets/Models/ball.obj",			"Assets/Textures/ball.png",				"Assets/Output/ball.bin");
 	Resources::ModelLoader::CreateModelFile("Assets/Models/controller_all.obj",	"Assets/Textures/controller.png",		"Assets/Output/controller.bin");
@@ -246,20 +399,27 @@ RenderThread::RenderThread(u32 scale) :
 	Resources::ModelLoader::CreateModelFile("Assets/Models/golem.obj",			"Assets/Textures/golem.png",			"Assets/Output/golem.bin");
 	Resources::ModelLoader::CreateModelFile("Assets/Models/tnt.obj",			"Assets/Textures/tnt.png",				"Assets/Output/tnt.bin");
 
-	rasterizer.Init("Assets/Output/spaceship.bin", "Assets/Cubemaps/hall.png");
+	rasterizer.Init("Assets/Output/spaceship.bin", "Assets/Cubemaps/hall.png", IVec2(resX, resY));
 	start = GetNow();
 }
 #endif
 
-RenderThread::RenderThread(const char* file, const char* background, u32 scale) :
+RenderThread::RenderThread(const char* file, const char* background, u32 scale, u32 threads, u32 buffers) :
 	scaleFactor(scale),
 	resX(SIZEX / scale),
 	resY(SIZEY / scale)
 {
-	rasterizer.Init(file, background);
+	valid = AllocateFrames(buffers) && rasterizer.Init(file, background, IVec2(resX, resY), threads);
 	start = GetNow();
 }
 
 RenderThread::~RenderThread()
 {
+#ifndef _WIN32
+	StopPresenter();
+#endif
+	for (u32 i = 0; i < frameCount; i++)
+	{
+		free(frames[i]);
+	}
 }
@@ -1,5 +1,8 @@
 #include "Resources/ModelLoader.hpp"
 
+#include "Defines.hpp"
+#include "Resources/Texture.hpp"
+
 #define STBI_ONLY_PNG
 //#define STBI_NO_FAILURE_STRINGS
 #define STB_IMAGE_IMPLEMENTATION
@@ -7,10 +10,86 @@
 
 #include <string.h>
 #include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 using namespace Maths;
 using namespace Resources;
 
+// Model files start with a ModelHeader, followed by these sections, each padded to a multiple of 4 bytes:
+// - the vertex attributes, one array per component: x, y, z, then nx, ny, nz (or the two octahedral values), then u, v
+// - the index buffer, 16 bit when there are at most 65536 vertices
+// - the clusters, with the fields of Cluster in order
+// - the texture, a png file unless textureLevels is set
+const u32 modelMagic = 0x4d32434f; // "OC2M"
+const u32 modelVersion = 4;
+const u32 clusterWords = 12;
+
+// Encodings of the vertex attributes, stored as 32 bit floats when their flag is clear, and of the texture
+// Positions as 16 bit fractions of the bounding box
+const u32 positionQuantized = 0x1;
+// Normals mapped on an octahedron, two signed 16 bit values
+const u32 normalOctahedral = 0x2;
+// Texture coordinates as 16 bit fractions of their range
+const u32 uvQuantized = 0x4;
+// Texture ready to sample: width, height, the Texture::SamplingLayout it was prepared for, the level count,
+// then the texels of every level in that layout
+const u32 textureLevels = 0x20;
+
+struct ModelHeader
+{
+	u32 magic;
+	u32 version;
+	u32 flags;
+	u32 vertexCount;
+	u32 indexCount;
+	u32 clusterCount;
+	// Size of the texture section in bytes
+	u32 textureSize;
+	// Ranges of the quantized attributes
+	f32 positionMin[3];
+	f32 positionMax[3];
+	f32 uvMin[2];
+	f32 uvMax[2];
+	// Surface parameters, see Material
+	f32 shininess;
+};
+
+const u32 headerWords = sizeof(ModelHeader) / sizeof(u32);
+
+// Files without the magic number use the legacy layout: the triangle count, three raw vertices per triangle,
+// the texture size in words and the texture.
+// Number of floats describing one legacy vertex: position, normal and uv
+const u32 vertexFloats = 8;
+
+// Walks through the sections of a file
+struct SectionReader
+{
+	u32* data;
+	u32 len;
+	u32 pos;
+
+	// Start of the next array of the given size, NULL when the file is too short
+	void* Take(u64 bytes)
+	{
+		const u64 words = (bytes + sizeof(u32) - 1) / sizeof(u32);
+		if (words > len - pos) return NULL;
+		u32* result = data + pos;
+		pos += (u32)words;
+		return result;
+	}
+};
+
+bool AllocateMesh(u32 vertexCount, u32 indexCount, Mesh& mesh);
+bool BuildMesh(const u32* corners, u32 cornerCount, Cluster* clusters, u32 clusterCount, Mesh& mesh);
+bool ReadVertices(const ModelHeader& header, SectionReader& in, f32* storage, Mesh& mesh);
+Cluster* SplitClusters(u32 triangleCount, u32& clusterCount);
+void ComputeClusterBounds(const Mesh& mesh, Cluster& cluster);
+
 char* ModelLoader::LoadFile(const char* path, u32* sizeOut)
 {
 #ifdef _WIN32
@@ -61,6 +140,51 @@ bool ModelLoader::SaveFile(const char* path, const u32* data, u32 size)
 	return true;
 }
 
+bool ModelLoader::OpenModelFile(const char* path, ModelFile& file)
+{
+#ifndef _WIN32
+	const int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(u32))
+	{
+		// private writable pages are never written to, but this lets the sections be used as regular arrays
+		void* ptr = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (ptr != MAP_FAILED)
+		{
+			close(fd);
+			file.data = static_cast<u32*>(ptr);
+			file.size = (u32)(info.st_size);
+			file.mapped = true;
+			return true;
+		}
+		printf("Warning - cannot map file %s (error %d), falling back to reading it\n", path, errno);
+	}
+	if (fd >= 0) close(fd);
+#endif
+	u32 size = 0;
+	char* data = LoadFile(path, &size);
+	if (data == NULL || !size)
+	{
+		free(data);
+		return false;
+	}
+	file.data = reinterpret_cast<u32*>(data);
+	file.size = size;
+	file.mapped = false;
+	return true;
+}
+
+void ModelFile::Close()
+{
+#ifndef _WIN32
+	if (mapped) munmap(data, size);
+	else free(data);
+#else
+	free(data);
+#endif
+	*this = ModelFile();
+}
+
 u32 ModelLoader::GetFileSize(FILE* in)
 {
 	fseek(in, 0, SEEK_END);
@@ -69,408 +193,1200 @@ u32 ModelLoader::GetFileSize(FILE* in)
 	return result;
 }
 
-#ifdef _WIN32
+// The converter needs the C++ library, which Sedna does not have, so it is only built for Windows and the converter tool
+#if defined(_WIN32) || defined(MODEL_CONVERTER)
 
-#include <string>
 #include <vector>
+#include <string>
 #include <bit>
+#include <algorithm>
 
-bool compareWord(const char* buff, int64_t index, const int64_t maxSize, const char* inputWord)
-{
-    for (index; index < maxSize && (buff[index] == ' ' || buff[index] == '\t'); index++) {}
-    for (int64_t i = 0; inputWord[i] != 0; i++)
-    {
-        if ((index + i > maxSize) || (inputWord[i] != buff[index + i]))
-            return false;
-    }
-    return true;
-}
-
-int countSlash(const char* buff, int64_t index, const int64_t maxSize)
-{
-    int result = 0;
-    while (index < maxSize && buff[index] != ' ' && buff[index] != '\n')
-    {
-        if (buff[index] == '/')
-        {
-            if (buff[index + 1] == '/')
-                return -1;
-            else
-                result += 1;
-        }
-        index++;
-    }
-    return result;
-}
-
-int64_t skipCharSafe(const char* buff, int64_t index, const int64_t maxSize)
-{
-    while (index < maxSize && buff[index] != ' ' && buff[index] != '\n' && buff[index] != '/')
-    {
-        index += 1;
-    }
-    if (buff[index] == ' ')
-    {
-        while (index < maxSize && buff[index] == ' ')
-        {
-            index += 1;
-        }
-        return index;
-    }
-    return index + 1;
-}
-
-int64_t skipChar(const char* buff, int64_t index, const int64_t maxSize, const char cr)
-{
-    while (index < maxSize && buff[index] != cr)
-        index += 1;
-    return index + 1;
-}
-
-int64_t endLine(const char* buff, int64_t index, const int64_t maxSize)
-{
-    return skipChar(buff, index, maxSize, '\n');
-}
-
-int64_t getInt(const char* buf, int64_t index, const int64_t maxSize)
-{
-    int64_t value = 0;
-    if (index >= maxSize) return value;
-    char n = buf[index];
-    bool negative = false;
-    if (n == '-')
-    {
-        negative = true;
-        index++;
-        n = buf[index];
-    }
-    while (n >= '0' && n <= '9' && index < maxSize)
-    {
-        value *= 10;
-        value += (int64_t)n - '0';
-        index++;
-        n = buf[index];
-    }
-    return (negative ? -value : value);
-}
-
-float getFloat(const char* buf, int64_t index, const int64_t maxSize)
-{
-    float value = 0;
-    if (index >= maxSize) return value;
-    char n = buf[index];
-    bool negative = false;
-    if (n == '-')
-    {
-        negative = true;
-        index++;
-        n = buf[index];
-    }
-    while (n >= '0' && n <= '9' && index < maxSize)
-    {
-        value *= 10;
-        value += n - '0';
-        index++;
-        n = buf[index];
-    }
-    if (index >= maxSize) return (negative ? -value : value);
-    if (n != '.') return (negative ? -value : value);
-    index++;
-    n = buf[index];
-    unsigned int decimal = 10;
-    while (n >= '0' && n <= '9' && decimal < 100000000u && index < maxSize)
-    {
-        value = value + (float)(n - '0') / decimal;
-        decimal *= 10;
-        index++;
-        n = buf[index];
-    }
-    return (negative ? -value : value);
-}
-
-
-std::string getLine(const char* buf, int64_t& index, const int64_t maxSize)
-{
-    std::string line;
-    while (buf[index] != '\r' && buf[index] != '\0' && buf[index] != '\n' && index < maxSize)
-    {
-        line.push_back(buf[index]);
-        index++;
-    }
-    return line;
-}
-
-bool ReadVec3(const char* buff, int64_t index, const int64_t maxSize, Vec3& result)
-{
-    float a = getFloat(buff, index, maxSize);
-    index = skipCharSafe(buff, index, maxSize);
-    if (index >= maxSize)
-    {
-        return false;
-    }
-    float b = getFloat(buff, index, maxSize);
-    index = skipCharSafe(buff, index, maxSize);
-    if (index >= maxSize)
-    {
-        return false;
-    }
-    float c = getFloat(buff, index, maxSize);
-    result = Vec3(a, b, c);
-    return true;
-}
-
-bool ReadVec2(const char* buff, int64_t index, const int64_t maxSize, Vec2& result)
-{
-    float a = getFloat(buff, index, maxSize);
-    index = skipCharSafe(buff, index, maxSize);
-    if (index >= maxSize)
-    {
-        return false;
-    }
-    float b = getFloat(buff, index, maxSize);
-    result = Vec2(a, b);
-    return true;
-}
-
-std::vector<TriangleData> faces;
-std::vector<Vec3> vertices;
-std::vector<Vec3> normals;
-std::vector<Vec2> tCoord;
-
-void ReadFace(int64_t& pos, size_t& objIndex, signed char& type, const char* data, const int64_t& size)
-{
-	if (type == -10)
-	{
-		type = countSlash(data, pos, size);
-	}
-	unsigned int v[3] = { 0 };
-	unsigned int n[3] = { 0 };
-	unsigned int t[3] = { 0 };
-	if (type == -1)
-	{
-		v[0] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		pos += 1;
-		n[0] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		v[1] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		pos += 1;
-		n[1] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		v[2] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		pos += 1;
-		n[2] = (unsigned int)getInt(data, pos, size) - 1;
-	}
-	else if (type == 0)
-	{
-		v[0] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		v[1] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		v[2] = (unsigned int)getInt(data, pos, size) - 1;
-	}
-	else if (type == 1)
-	{
-		v[0] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		t[0] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		v[1] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		t[1] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		v[2] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		t[2] = (unsigned int)getInt(data, pos, size) - 1;
-	}
-	else if (type == 2)
-	{
-		v[0] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		t[0] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		n[0] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		v[1] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		t[1] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		n[1] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		v[2] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		t[2] = (unsigned int)getInt(data, pos, size) - 1;
-		pos = skipCharSafe(data, pos, size);
-		n[2] = (unsigned int)getInt(data, pos, size) - 1;
-	}
-	TriangleData tmp;
-	for (int i = 0; i < 3; i++)
-	{
-		auto& vert = tmp.data[i];
-		vert.pos = vertices[v[i]];
-		if (!normals.empty()) vert.norm = normals[n[i]];
-		if (!tCoord.empty()) vert.uv = tCoord[t[i]];
-		vert.uv.y = 1 - vert.uv.y;
-	}
-	faces.push_back(tmp);
-}
-
-signed char Loop(const std::string& str)
-{
-	faces.clear();
-	vertices.clear();
-	normals.clear();
-	tCoord.clear();
-	size_t objIndex = 0;
-	int64_t pos = 0;
-	signed char type = -10;
-	s64 size = str.size();
-	const char* data = str.data();
-	while (pos < size)
-	{
-		if (compareWord(data, pos, size, "v "))
-		{
-			pos = skipCharSafe(data, pos, size);
-			float a = getFloat(data, pos, size);
-			pos = skipCharSafe(data, pos, size);
-			float b = getFloat(data, pos, size);
-			pos = skipCharSafe(data, pos, size);
-			float c = getFloat(data, pos, size);
-			vertices.push_back(Vec3(a, b, c));
-		}
-		else if (compareWord(data, pos, size, "vn "))
-		{
-			pos = skipCharSafe(data, pos, size);
-			float a = getFloat(data, pos, size);
-			pos = skipCharSafe(data, pos, size);
-			float b = getFloat(data, pos, size);
-			pos = skipCharSafe(data, pos, size);
-			float c = getFloat(data, pos, size);
-			normals.push_back(Vec3(a, b, c));
-		}
-		else if (compareWord(data, pos, size, "vt "))
-		{
-			pos = skipCharSafe(data, pos, size);
-			float a = getFloat(data, pos, size);
-			pos = skipCharSafe(data, pos, size);
-			float b = getFloat(data, pos, size);
-			tCoord.push_back(Vec2(a, b));
-		}
-		else if (compareWord(data, pos, size, "f "))
-		{
-			pos = skipCharSafe(data, pos, size);
-			ReadFace(pos, objIndex, type, data, size);
-		}
-		pos = endLine(data, pos, size);
-	}
-	return type;
-}
-
-void ModelLoader::CreateModelFile(const char* source, const char* tex, const char* dest)
+// Corner of an obj face: indices of its position, uv and normal, the last two being ~0u when missing
+struct ObjCorner
 {
-	u32 size;
-	char* tmp = LoadFile(source, &size);
-	if (tmp == NULL || !size)
+	u32 v;
+	u32 t;
+	u32 n;
+};
+
+// Contents of an obj file, with the corners sharing the same indices merged as they are read
+struct ObjData
+{
+	std::vector<Vec3> positions;
+	std::vector<Vec2> uvs;
+	std::vector<Vec3> normals;
+	std::vector<ObjCorner> corners;
+	// Three corners per triangle
+	std::vector<u32> triangles;
+	// Open addressing table of the corners, ~0u marks free slots
+	std::vector<u32> table;
+	// First material library and material named by the file, models are drawn with a single material
+	std::string materialLibrary;
+	std::string materialName;
+
+	u32 AddCorner(const ObjCorner& c);
+};
+
+u32 HashCorner(const ObjCorner& c)
+{
+	u32 hash = 2166136261u;
+	hash = (hash ^ c.v) * 16777619u;
+	hash = (hash ^ c.t) * 16777619u;
+	hash = (hash ^ c.n) * 16777619u;
+	return hash;
+}
+
+u32 ObjData::AddCorner(const ObjCorner& c)
+{
+	// the table is kept at most half full, growing it means placing every corner again
+	if (corners.size() * 2 >= table.size())
+	{
+		table.assign(table.empty() ? 1024 : table.size() * 2, ~0u);
+		const u32 mask = (u32)(table.size() - 1);
+		for (u32 i = 0; i < corners.size(); i++)
+		{
+			u32 slot = HashCorner(corners[i]) & mask;
+			while (table[slot] != ~0u) slot = (slot + 1) & mask;
+			table[slot] = i;
+		}
+	}
+	const u32 mask = (u32)(table.size() - 1);
+	u32 slot = HashCorner(c) & mask;
+	while (table[slot] != ~0u)
 	{
-		return;
+		const ObjCorner& other = corners[table[slot]];
+		if (other.v == c.v && other.t == c.t && other.n == c.n) return table[slot];
+		slot = (slot + 1) & mask;
 	}
-	std::string data;
-	data.resize(size);
-	memcpy(data.data(), tmp, size);
-	free(tmp);
-	Loop(data);
+	table[slot] = (u32)(corners.size());
+	corners.push_back(c);
+	return table[slot];
+}
 
-	std::vector<u32> output;
+const char* SkipSpaces(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	return p;
+}
 
-	output.push_back((u32)(faces.size()));
-	for (u32 i = 0; i < faces.size(); i++)
+// Reads a decimal number such as -1.25e-3. Much faster than strtof, as it ignores locales, hexadecimal and infinities,
+// while staying within a rounding of the exact value for the up to 18 significant digits it keeps.
+const char* ParseFloat(const char* p, const char* end, f32& value)
+{
+	static const f64 powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	p = SkipSpaces(p, end);
+	const bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+')) p++;
+	u64 mantissa = 0;
+	s32 exponent = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
 	{
-		TriangleData t = faces[i];
-		u32* ptr = reinterpret_cast<u32*>(t.data);
-		for (int j = 0; j < 24; j++)
+		if (mantissa < 100000000000000000ull) mantissa = mantissa * 10 + (*p - '0');
+		else exponent++;
+	}
+	if (p < end && *p == '.')
+	{
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+		{
+			if (mantissa >= 100000000000000000ull) continue;
+			mantissa = mantissa * 10 + (*p - '0');
+			exponent--;
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		const bool negativeExponent = p < end && *p == '-';
+		if (p < end && (*p == '-' || *p == '+')) p++;
+		s32 e = 0;
+		for (; p < end && *p >= '0' && *p <= '9'; p++)
+		{
+			if (e < 10000) e = e * 10 + (*p - '0');
+		}
+		exponent += negativeExponent ? -e : e;
+	}
+	f64 result = (f64)mantissa;
+	for (; exponent > 22 && result != 0; exponent -= 22) result *= 1e22;
+	for (; exponent < -22 && result != 0; exponent += 22) result /= 1e22;
+	if (exponent < -22 || exponent > 22) exponent = 0;
+	result = exponent < 0 ? result / powers[-exponent] : result * powers[exponent];
+	value = (f32)(negative ? -result : result);
+	return p;
+}
+
+// Reads an obj index, turning it into an offset from the start of its array. Relative indices count back
+// from the end of the array, missing or out of range ones give ~0u
+const char* ParseIndex(const char* p, const char* end, size_t count, u32& index)
+{
+	const bool negative = p < end && *p == '-';
+	if (negative) p++;
+	s64 value = 0;
+	const char* start = p;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+	{
+		if (value < 0x100000000ll) value = value * 10 + (*p - '0');
+	}
+	if (p == start) value = 0;
+	if (negative) value = (s64)count - value;
+	else value--;
+	index = value >= 0 && value < (s64)count ? (u32)value : ~0u;
+	return p;
+}
+
+// Reads the corners of a face line and splits polygons in triangle fans. Faces referencing missing positions are dropped
+void ParseFace(const char* p, const char* end, ObjData& obj)
+{
+	u32 first = 0;
+	u32 previous = 0;
+	u32 count = 0;
+	bool valid = true;
+	while ((p = SkipSpaces(p, end)) < end)
+	{
+		ObjCorner c = { ~0u, ~0u, ~0u };
+		p = ParseIndex(p, end, obj.positions.size(), c.v);
+		if (p < end && *p == '/')
 		{
-			output.push_back(ptr[j]);
+			p++;
+			if (p < end && *p != '/') p = ParseIndex(p, end, obj.uvs.size(), c.t);
+			if (p < end && *p == '/') p = ParseIndex(p + 1, end, obj.normals.size(), c.n);
 		}
+		// anything else up to the next space is not part of the format
+		while (p < end && *p != ' ' && *p != '\t') p++;
+		valid &= c.v != ~0u;
+		if (!valid) continue;
+		const u32 corner = obj.AddCorner(c);
+		if (count == 0) first = corner;
+		else if (count >= 2)
+		{
+			obj.triangles.push_back(first);
+			obj.triangles.push_back(previous);
+			obj.triangles.push_back(corner);
+		}
+		previous = corner;
+		count++;
 	}
+}
 
+// Rest of the line without its surrounding spaces, names may contain spaces
+std::string LineArgument(const char* p, const char* end)
+{
+	p = SkipSpaces(p, end);
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t')) end--;
+	return std::string(p, end - p);
+}
+
+// Reads the lines of the chunk, which ends with a complete line
+void ParseLines(const char* p, const char* end, ObjData& obj)
+{
+	while (p < end)
+	{
+		const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+		if (lineEnd == NULL) lineEnd = end;
+		const char* q = SkipSpaces(p, lineEnd);
+		// carriage returns of windows line endings are left out of the line
+		const char* last = lineEnd > q && lineEnd[-1] == '\r' ? lineEnd - 1 : lineEnd;
+		if (last - q >= 2 && q[0] == 'v' && q[1] == ' ')
+		{
+			Vec3 v;
+			q = ParseFloat(q + 2, last, v.x);
+			q = ParseFloat(q, last, v.y);
+			ParseFloat(q, last, v.z);
+			obj.positions.push_back(v);
+		}
+		else if (last - q >= 3 && q[0] == 'v' && q[1] == 't' && (q[2] == ' ' || q[2] == '\t'))
+		{
+			Vec2 v;
+			q = ParseFloat(q + 3, last, v.x);
+			ParseFloat(q, last, v.y);
+			obj.uvs.push_back(v);
+		}
+		else if (last - q >= 3 && q[0] == 'v' && q[1] == 'n' && (q[2] == ' ' || q[2] == '\t'))
+		{
+			Vec3 v;
+			q = ParseFloat(q + 3, last, v.x);
+			q = ParseFloat(q, last, v.y);
+			ParseFloat(q, last, v.z);
+			obj.normals.push_back(v);
+		}
+		else if (last - q >= 2 && q[0] == 'f' && (q[1] == ' ' || q[1] == '\t'))
+		{
+			ParseFace(q + 2, last, obj);
+		}
+		else if (last - q > 7 && !memcmp(q, "mtllib", 6) && (q[6] == ' ' || q[6] == '\t') && obj.materialLibrary.empty())
+		{
+			obj.materialLibrary = LineArgument(q + 7, last);
+		}
+		else if (last - q > 7 && !memcmp(q, "usemtl", 6) && (q[6] == ' ' || q[6] == '\t') && obj.materialName.empty())
+		{
+			obj.materialName = LineArgument(q + 7, last);
+		}
+		p = lineEnd + 1;
+	}
+}
+
+// Reads the obj file a chunk at a time, so that only the parsed data has to fit in memory
+bool ParseObjFile(const char* path, ObjData& obj)
+{
+#ifdef _WIN32
+	FILE* file;
+	fopen_s(&file, path, "rb");
+#else
+	FILE* file = fopen(path, "rb");
+#endif
+	if (file == NULL)
+	{
+		printf("Error - cannot open file %s\n", path);
+		printf("Error code : %d\n", errno);
+		return false;
+	}
+	const size_t chunkSize = 1 << 20;
+	std::vector<char> chunk(chunkSize);
+	size_t kept = 0;
+	bool valid = true;
+	while (true)
+	{
+		const size_t read = fread(chunk.data() + kept, 1, chunkSize - kept, file);
+		const size_t size = kept + read;
+		if (read == 0)
+		{
+			ParseLines(chunk.data(), chunk.data() + size, obj);
+			break;
+		}
+		// the last line of the chunk is usually cut, it is moved to the start of the next one
+		size_t complete = size;
+		while (complete > 0 && chunk[complete - 1] != '\n') complete--;
+		if (complete == 0)
+		{
+			valid = size < chunkSize;
+			if (!valid)
+			{
+				printf("Error - file %s has a line longer than %zu bytes\n", path, chunkSize);
+				break;
+			}
+			kept = size;
+			continue;
+		}
+		ParseLines(chunk.data(), chunk.data() + complete, obj);
+		kept = size - complete;
+		memmove(chunk.data(), chunk.data() + complete, kept);
+	}
+	fclose(file);
+	if (valid && obj.triangles.empty())
+	{
+		printf("Error - file %s has no faces\n", path);
+		valid = false;
+	}
+	return valid;
+}
+
+// Reads the material used by the obj file from its library, which is looked for next to the obj file.
+// Models without one keep the default material, as does the first material of the library when none is used.
+// path receives the location of the library, even when it cannot be opened, and stays empty without one
+Material ReadMaterial(const char* objPath, const ObjData& obj, std::string& path)
+{
+	Material material;
+	path.clear();
+	if (obj.materialLibrary.empty())
+	{
+		return material;
+	}
+	path = objPath;
+	const size_t slash = path.find_last_of("/\\");
+	path = (slash == std::string::npos ? std::string() : path.substr(0, slash + 1)) + obj.materialLibrary;
+#ifdef _WIN32
+	FILE* file;
+	fopen_s(&file, path.c_str(), "rb");
+#else
+	FILE* file = fopen(path.c_str(), "rb");
+#endif
+	if (file == NULL)
+	{
+		printf("Warning - cannot open material library %s, using the default material\n", path.c_str());
+		return material;
+	}
+	char line[1024];
+	bool current = false;
+	bool found = false;
+	while (fgets(line, sizeof(line), file))
+	{
+		const char* end = line + strlen(line);
+		while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+		const char* q = SkipSpaces(line, end);
+		if (end - q > 7 && !memcmp(q, "newmtl", 6) && (q[6] == ' ' || q[6] == '\t'))
+		{
+			q = SkipSpaces(q + 7, end);
+			current = !found && (obj.materialName.empty() || obj.materialName.compare(0, std::string::npos, q, end - q) == 0);
+			found |= current;
+		}
+		else if (current && end - q > 3 && q[0] == 'N' && q[1] == 's' && (q[2] == ' ' || q[2] == '\t'))
+		{
+			ParseFloat(q + 3, end, material.shininess);
+		}
+	}
+	fclose(file);
+	if (!found)
+	{
+		printf("Warning - material %s is missing from %s, using the default material\n", obj.materialName.c_str(), path.c_str());
+	}
+	// the mtl format allows exponents from 0 to 1000, 0 would light every pixel fully
+	material.shininess = Util::MaxF(Util::MinF(material.shininess, 1000.0f), 1.0f);
+	return material;
+}
+
+// Spreads the low 10 bits of v so that they can be interleaved with two other values
+u32 SpreadBits(u32 v)
+{
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+// Orders the triangles along a Morton curve of their centers, so that consecutive triangles make compact clusters
+void SortTriangles(ObjData& obj)
+{
+	const size_t count = obj.triangles.size() / 3;
+	Vec3 low = Vec3(VEC_HIGH_VALUE);
+	Vec3 high = Vec3(-VEC_HIGH_VALUE);
+	std::vector<Vec3> centers(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const u32* t = &obj.triangles[i * 3];
+		centers[i] = (obj.positions[obj.corners[t[0]].v] + obj.positions[obj.corners[t[1]].v] + obj.positions[obj.corners[t[2]].v]) / 3;
+		for (int k = 0; k < 3; k++)
+		{
+			low[k] = Util::MinF(low[k], centers[i][k]);
+			high[k] = Util::MaxF(high[k], centers[i][k]);
+		}
+	}
+	std::vector<std::pair<u32, u32>> keys(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		u32 key = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			const f32 extent = high[k] - low[k];
+			const u32 cell = extent > 0 ? (u32)((centers[i][k] - low[k]) / extent * 1023) : 0;
+			key |= SpreadBits(cell) << k;
+		}
+		keys[i] = std::make_pair(key, (u32)i);
+	}
+	std::sort(keys.begin(), keys.end());
+	std::vector<u32> sorted(obj.triangles.size());
+	for (size_t i = 0; i < count; i++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			sorted[i * 3 + k] = obj.triangles[keys[i].second * 3 + k];
+		}
+	}
+	obj.triangles.swap(sorted);
+}
+
+// Gives each cluster its own copy of the corners it uses and fills the mesh with their attributes
+bool BuildObjMesh(const ObjData& obj, Cluster* clusters, u32 clusterCount, Mesh& mesh)
+{
+	std::vector<u32> vertexOf(obj.corners.size(), ~0u);
+	std::vector<u32> cornerOf;
+	std::vector<u32> indices(obj.triangles.size());
+	for (u32 k = 0; k < clusterCount; k++)
+	{
+		Cluster& cluster = clusters[k];
+		cluster.firstVertex = (u32)(cornerOf.size());
+		for (u32 i = cluster.firstTriangle * 3; i < (cluster.firstTriangle + cluster.triangleCount) * 3; i++)
+		{
+			const u32 corner = obj.triangles[i];
+			// corners not used yet or used by a previous cluster get a new vertex
+			if (vertexOf[corner] == ~0u || vertexOf[corner] < cluster.firstVertex)
+			{
+				vertexOf[corner] = (u32)(cornerOf.size());
+				cornerOf.push_back(corner);
+			}
+			indices[i] = vertexOf[corner];
+		}
+		cluster.vertexCount = (u32)(cornerOf.size()) - cluster.firstVertex;
+	}
+	if (!AllocateMesh((u32)(cornerOf.size()), (u32)(indices.size()), mesh))
+	{
+		return false;
+	}
+	mesh.clusterCount = clusterCount;
+	mesh.clusters = clusters;
+	for (u32 i = 0; i < mesh.vertexCount; i++)
+	{
+		const ObjCorner& c = obj.corners[cornerOf[i]];
+		const Vec3 p = obj.positions[c.v];
+		const Vec3 n = c.n != ~0u ? obj.normals[c.n] : Vec3();
+		const Vec2 uv = c.t != ~0u ? obj.uvs[c.t] : Vec2();
+		mesh.x[i] = p.x;
+		mesh.y[i] = p.y;
+		mesh.z[i] = p.z;
+		mesh.nx[i] = n.x;
+		mesh.ny[i] = n.y;
+		mesh.nz[i] = n.z;
+		// obj images have their origin at the bottom
+		mesh.u[i] = uv.x;
+		mesh.v[i] = 1 - uv.y;
+	}
+	for (u32 i = 0; i < mesh.indexCount; i++)
+	{
+		if (mesh.indices16) mesh.indices16[i] = (u16)(indices[i]);
+		else mesh.indices32[i] = indices[i];
+	}
+	return true;
+}
+
+// Maps v from [low, high] to the full 16 bit range
+u16 Quantize(f32 v, f32 low, f32 high)
+{
+	if (high <= low) return 0;
+	return (u16)(Util::MinF(Util::MaxF((v - low) / (high - low), 0), 1) * 65535 + 0.5f);
+}
+
+// Folds a unit vector onto the octahedron unfolded in the [-1, 1] square
+void EncodeOctahedral(Vec3 n, s16& a, s16& b)
+{
+	n = n / (fabsf(n.x) + fabsf(n.y) + fabsf(n.z));
+	f32 x = n.x;
+	f32 y = n.y;
+	if (n.z < 0)
+	{
+		x = (1 - fabsf(n.y)) * (n.x < 0 ? -1 : 1);
+		y = (1 - fabsf(n.x)) * (n.y < 0 ? -1 : 1);
+	}
+	a = (s16)(roundf(Util::MinF(Util::MaxF(x, -1), 1) * 32767));
+	b = (s16)(roundf(Util::MinF(Util::MaxF(y, -1), 1) * 32767));
+}
+
+// Appends an array to the file, padded to a whole number of words
+void AppendArray(std::vector<u32>& output, const void* data, size_t bytes)
+{
+	const size_t start = output.size();
+	output.resize(start + (bytes + sizeof(u32) - 1) / sizeof(u32), 0);
+	memcpy(output.data() + start, data, bytes);
+}
+
+// Decodes the png file and prepares it like the rasterizer would, then stores the levels ready to sample.
+// Returns textureLevels, or 0 when the file is not a valid png
+u32 EncodeTexture(const char* png, u32 size, std::vector<u32>& output)
+{
+	IVec2 res;
+	s32 comp;
+	u8* data = stbi_load_from_memory(reinterpret_cast<const u8*>(png), size, &res.x, &res.y, &comp, 4);
+	if (data == NULL)
+	{
+		printf("Error - failed to load texture: %s\n", stbi_failure_reason());
+		return 0;
+	}
+	Texture texture = Texture(reinterpret_cast<u32*>(data), res);
+#ifdef TEX_ALPHA
+	const bool prepared = texture.Prepare(true, true);
+#else
+	const bool prepared = texture.Prepare(true, false);
+#endif
+	if (!prepared)
+	{
+		texture.Destroy();
+		return 0;
+	}
+	output.push_back(res.x);
+	output.push_back(res.y);
+	output.push_back(Texture::SamplingLayout());
+	output.push_back(texture.GetMipCount());
+	// the levels follow each other without padding, as FromLevels expects them
+	std::vector<u8> texels;
+	for (u32 l = 0; l < texture.GetMipCount(); l++)
+	{
+		u64 bytes = 0;
+		const u8* level = static_cast<const u8*>(texture.GetLevelTexels(l, bytes));
+		texels.insert(texels.end(), level, level + bytes);
+	}
+	AppendArray(output, texels.data(), texels.size());
+	texture.Destroy();
+	return textureLevels;
+}
+
+// Writes a section to the file and empties it for the next one
+bool WriteSection(FILE* file, std::vector<u32>& section)
+{
+	const bool written = fwrite(section.data(), sizeof(u32), section.size(), file) == section.size();
+	section.clear();
+	return written;
+}
+
+bool ModelLoader::CreateModelFile(const char* source, const char* tex, const char* dest, bool decodeTexture, std::string* materialLibrary)
+{
+	ObjData obj;
+	if (!ParseObjFile(source, obj))
+	{
+		return false;
+	}
+	SortTriangles(obj);
+	std::string library;
+	const Material material = ReadMaterial(source, obj, library);
+	if (materialLibrary) *materialLibrary = library;
+
+	u32 size;
 	char* texFile = LoadFile(tex, &size);
 	if (texFile == NULL || !size)
 	{
-		return;
+		return false;
 	}
+	std::vector<u32> texture;
+	const u32 textureFlags = decodeTexture ? EncodeTexture(texFile, size, texture) : 0;
+	if (!textureFlags) AppendArray(texture, texFile, size);
+	free(texFile);
 
-	const bool extra = size & (sizeof(u32) - 1);
-	const u32 size2 = size / sizeof(u32);
+	u32 clusterCount = 0;
+	Cluster* clusters = SplitClusters((u32)(obj.triangles.size() / 3), clusterCount);
+	Mesh mesh;
+	if (clusters == NULL || !BuildObjMesh(obj, clusters, clusterCount, mesh))
+	{
+		free(clusters);
+		return false;
+	}
+	obj = ObjData();
+	const u32 count = mesh.vertexCount;
 
-	output.push_back(size2 + (extra ? 1 : 0));
+	ModelHeader header = {};
+	header.magic = modelMagic;
+	header.version = modelVersion;
+	header.flags = positionQuantized | uvQuantized | textureFlags;
+	header.vertexCount = count;
+	header.indexCount = mesh.indexCount;
+	header.clusterCount = clusterCount;
+	header.textureSize = textureFlags ? (u32)(texture.size() * sizeof(u32)) : size;
+	header.shininess = material.shininess;
+	f32* positions[3] = { mesh.x, mesh.y, mesh.z };
+	f32* normals[3] = { mesh.nx, mesh.ny, mesh.nz };
+	f32* uvs[2] = { mesh.u, mesh.v };
+	for (u32 k = 0; k < 3; k++)
+	{
+		header.positionMin[k] = positions[k][0];
+		header.positionMax[k] = positions[k][0];
+		for (u32 i = 1; i < count; i++)
+		{
+			header.positionMin[k] = Util::MinF(header.positionMin[k], positions[k][i]);
+			header.positionMax[k] = Util::MaxF(header.positionMax[k], positions[k][i]);
+		}
+	}
+	for (u32 k = 0; k < 2; k++)
+	{
+		header.uvMin[k] = uvs[k][0];
+		header.uvMax[k] = uvs[k][0];
+		for (u32 i = 1; i < count; i++)
+		{
+			header.uvMin[k] = Util::MinF(header.uvMin[k], uvs[k][i]);
+			header.uvMax[k] = Util::MaxF(header.uvMax[k], uvs[k][i]);
+		}
+	}
+	// models without normals keep the raw zero vectors, they have no place on the octahedron
+	bool unitNormals = true;
+	for (u32 i = 0; i < count && unitNormals; i++)
+	{
+		unitNormals = Vec3(mesh.nx[i], mesh.ny[i], mesh.nz[i]).Length() > 0;
+	}
+	if (unitNormals) header.flags |= normalOctahedral;
 
-	const u32* ptr = reinterpret_cast<const u32*>(texFile);
-	for (u32 i = 0; i < size2; i++)
+#ifdef _WIN32
+	FILE* file;
+	fopen_s(&file, dest, "wb");
+#else
+	FILE* file = fopen(dest, "wb");
+#endif
+	if (file == NULL)
 	{
-		output.push_back(ptr[i]);
+		printf("Error - cannot open file %s\n", dest);
+		printf("Error code : %d\n", errno);
+		mesh.Destroy();
+		return false;
 	}
-	if (extra)
+	// sections are written as soon as they are ready, the vertex one is first decoded again to bound the clusters
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+	std::vector<u32> output;
+	std::vector<u16> values(count);
+	for (u32 k = 0; k < 3; k++)
 	{
-		u32 number;
-		u8* numPtr = reinterpret_cast<u8*>(&number);
-		for (u32 i = size2 * sizeof(u32); i < size; i++)
+		for (u32 i = 0; i < count; i++)
 		{
-			numPtr[i - size2 * sizeof(u32)] = texFile[i];
+			values[i] = Quantize(positions[k][i], header.positionMin[k], header.positionMax[k]);
 		}
-		output.push_back(number);
+		AppendArray(output, values.data(), count * sizeof(u16));
+	}
+	if (unitNormals)
+	{
+		std::vector<s16> a(count);
+		std::vector<s16> b(count);
+		for (u32 i = 0; i < count; i++)
+		{
+			EncodeOctahedral(Vec3(mesh.nx[i], mesh.ny[i], mesh.nz[i]), a[i], b[i]);
+		}
+		AppendArray(output, a.data(), count * sizeof(s16));
+		AppendArray(output, b.data(), count * sizeof(s16));
+	}
+	else
+	{
+		for (u32 k = 0; k < 3; k++)
+		{
+			AppendArray(output, normals[k], count * sizeof(f32));
+		}
+	}
+	for (u32 k = 0; k < 2; k++)
+	{
+		for (u32 i = 0; i < count; i++)
+		{
+			values[i] = Quantize(uvs[k][i], header.uvMin[k], header.uvMax[k]);
+		}
+		AppendArray(output, values.data(), count * sizeof(u16));
 	}
-	free(texFile);
 
-	SaveFile(dest, output.data(), (u32)(output.size()));
+	// the clusters are bounded with the decoded vertices, as the renderer will see them
+	// raw components then point into output, so this has to be done before it is written
+	SectionReader in = { output.data(), (u32)(output.size()), 0 };
+	ReadVertices(header, in, static_cast<f32*>(mesh.block), mesh);
+	for (u32 k = 0; k < clusterCount; k++)
+	{
+		ComputeClusterBounds(mesh, clusters[k]);
+	}
+	written &= WriteSection(file, output);
+
+	if (mesh.indices16) AppendArray(output, mesh.indices16, mesh.indexCount * sizeof(u16));
+	else AppendArray(output, mesh.indices32, mesh.indexCount * sizeof(u32));
+	written &= WriteSection(file, output);
+	for (u32 k = 0; k < clusterCount; k++)
+	{
+		const Cluster& c = clusters[k];
+		const f32 bounds[] = { c.center.x, c.center.y, c.center.z, c.radius, c.coneAxis.x, c.coneAxis.y, c.coneAxis.z, c.coneCutoff };
+		output.push_back(c.firstTriangle);
+		output.push_back(c.triangleCount);
+		output.push_back(c.firstVertex);
+		output.push_back(c.vertexCount);
+		for (f32 v : bounds)
+		{
+			output.push_back(std::bit_cast<u32>(v));
+		}
+	}
+	written &= WriteSection(file, output);
+	written &= WriteSection(file, texture);
+	fclose(file);
+	mesh.Destroy();
+	if (!written)
+	{
+		printf("Error - failed to write file %s\n", dest);
+	}
+	return written;
 }
 
 #endif
 
-ModelData ModelLoader::ParseModelFile(const char* source, const char* skybox, u32* triCount)
+u32 HashVertex(const u32* data)
 {
-	ModelData result;
-	u32 size;
-	char* data = LoadFile(source, &size);
-	if (data == NULL || !size)
+	u32 hash = 2166136261u;
+	for (u32 i = 0; i < vertexFloats; i++)
 	{
-		return result;
+		hash = (hash ^ data[i]) * 16777619u;
 	}
-	u32 len = size / sizeof(u32);
-	u32* fData = reinterpret_cast<u32*>(data);
-	f32* tData = reinterpret_cast<f32*>(data);
-	u32 pos = 0;
-	u32 fCount = fData[0];
-	pos++;
-	Triangle* tris = (Triangle*)(malloc(fCount * sizeof(Triangle)));
-	if (triCount != NULL) *triCount = fCount;
-	if (tris == NULL || !size)
+	return hash;
+}
+
+bool SameVertex(const u32* a, const u32* b)
+{
+	for (u32 i = 0; i < vertexFloats; i++)
 	{
-		printf("Error - failed to allocate %zu bytes\nOut of memory?", fCount * sizeof(Triangle));
-		free(data);
-		return result;
+		if (a[i] != b[i]) return false;
+	}
+	return true;
+}
+
+// Allocates the attribute arrays and the index buffer of the mesh in a single block
+bool AllocateMesh(u32 vertexCount, u32 indexCount, Mesh& mesh)
+{
+	const bool shortIndices = vertexCount <= 0x10000;
+	const size_t indexSize = shortIndices ? sizeof(u16) : sizeof(u32);
+	const size_t bytes = (size_t)vertexCount * vertexFloats * sizeof(f32) + (size_t)indexCount * indexSize;
+	f32* block = (f32*)(malloc(bytes));
+	if (block == NULL)
+	{
+		printf("Error - failed to allocate %zu bytes\nOut of memory?", bytes);
+		return false;
+	}
+	mesh.vertexCount = vertexCount;
+	mesh.indexCount = indexCount;
+	mesh.block = block;
+	mesh.x = block;
+	mesh.y = block + vertexCount;
+	mesh.z = block + vertexCount * 2;
+	mesh.nx = block + vertexCount * 3;
+	mesh.ny = block + vertexCount * 4;
+	mesh.nz = block + vertexCount * 5;
+	mesh.u = block + vertexCount * 6;
+	mesh.v = block + vertexCount * 7;
+	void* indices = block + (size_t)vertexCount * vertexFloats;
+	mesh.indices16 = shortIndices ? static_cast<u16*>(indices) : NULL;
+	mesh.indices32 = shortIndices ? NULL : static_cast<u32*>(indices);
+	return true;
+}
+
+// Merges the identical vertices of the raw triangle list and splits their attributes into separate arrays.
+// Vertices are only shared inside a cluster, so that each cluster owns a contiguous range of them.
+bool BuildMesh(const u32* corners, u32 cornerCount, Cluster* clusters, u32 clusterCount, Mesh& mesh)
+{
+	u32 tableSize = 1;
+	while (tableSize < cornerCount * 2) tableSize <<= 1;
+	// the table holds the first corner using each vertex, remap gives the vertex of every corner
+	u32* table = (u32*)(malloc(tableSize * sizeof(u32)));
+	u32* remap = (u32*)(malloc(cornerCount * sizeof(u32)));
+	if (table == NULL || remap == NULL)
+	{
+		printf("Error - failed to allocate %zu bytes\nOut of memory?", (tableSize + cornerCount) * sizeof(u32));
+		free(table);
+		free(remap);
+		return false;
+	}
+	memset(table, 0xff, tableSize * sizeof(u32));
+
+	u32 vertexCount = 0;
+	for (u32 k = 0; k < clusterCount; k++)
+	{
+		Cluster& cluster = clusters[k];
+		cluster.firstVertex = vertexCount;
+		const u32 end = (cluster.firstTriangle + cluster.triangleCount) * 3;
+		for (u32 c = cluster.firstTriangle * 3; c < end; c++)
+		{
+			const u32* vertex = corners + c * vertexFloats;
+			u32 slot = HashVertex(vertex) & (tableSize - 1);
+			while (table[slot] != 0xffffffff && !SameVertex(corners + table[slot] * vertexFloats, vertex))
+			{
+				slot = (slot + 1) & (tableSize - 1);
+			}
+			// matches from previous clusters are replaced by a copy owned by this one
+			if (table[slot] == 0xffffffff || remap[table[slot]] < cluster.firstVertex)
+			{
+				table[slot] = c;
+				remap[c] = vertexCount++;
+			}
+			else
+			{
+				remap[c] = remap[table[slot]];
+			}
+		}
+		cluster.vertexCount = vertexCount - cluster.firstVertex;
+	}
+	free(table);
+
+	if (!AllocateMesh(vertexCount, cornerCount, mesh))
+	{
+		free(remap);
+		return false;
+	}
+	mesh.clusterCount = clusterCount;
+	mesh.clusters = clusters;
+
+	// vertices are numbered in order of first use, so the next new one always comes up in sequence
+	f32* arrays[vertexFloats] = { mesh.x, mesh.y, mesh.z, mesh.nx, mesh.ny, mesh.nz, mesh.u, mesh.v };
+	u32 filled = 0;
+	for (u32 c = 0; c < cornerCount; c++)
+	{
+		const u32 index = remap[c];
+		if (index == filled)
+		{
+			const f32* vertex = reinterpret_cast<const f32*>(corners + c * vertexFloats);
+			for (u32 i = 0; i < vertexFloats; i++)
+			{
+				arrays[i][index] = vertex[i];
+			}
+			filled++;
+		}
+		if (mesh.indices16) mesh.indices16[c] = (u16)index;
+		else mesh.indices32[c] = index;
+	}
+	free(remap);
+	return true;
+}
+
+// Cuts the triangle list in runs of CLUSTER_SIZE triangles
+Cluster* SplitClusters(u32 triangleCount, u32& clusterCount)
+{
+	clusterCount = (triangleCount + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	Cluster* clusters = (Cluster*)(malloc(clusterCount * sizeof(Cluster)));
+	if (clusters == NULL)
+	{
+		printf("Error - failed to allocate %zu bytes\nOut of memory?", clusterCount * sizeof(Cluster));
+		return NULL;
+	}
+	for (u32 k = 0; k < clusterCount; k++)
+	{
+		clusters[k].firstTriangle = k * CLUSTER_SIZE;
+		clusters[k].triangleCount = Util::MinI(CLUSTER_SIZE, triangleCount - k * CLUSTER_SIZE);
+	}
+	return clusters;
+}
+
+// Bounding sphere and normal cone of a cluster, from the built mesh
+void ComputeClusterBounds(const Mesh& mesh, Cluster& cluster)
+{
+	Vec3 low = Vec3(VEC_HIGH_VALUE);
+	Vec3 high = Vec3(-VEC_HIGH_VALUE);
+	for (u32 i = cluster.firstVertex; i < cluster.firstVertex + cluster.vertexCount; i++)
+	{
+		const Vec3 p = Vec3(mesh.x[i], mesh.y[i], mesh.z[i]);
+		for (int k = 0; k < 3; k++)
+		{
+			low[k] = Util::MinF(low[k], p[k]);
+			high[k] = Util::MaxF(high[k], p[k]);
+		}
+	}
+	cluster.center = (low + high) * 0.5f;
+	cluster.radius = 0;
+	for (u32 i = cluster.firstVertex; i < cluster.firstVertex + cluster.vertexCount; i++)
+	{
+		cluster.radius = Util::MaxF(cluster.radius, (Vec3(mesh.x[i], mesh.y[i], mesh.z[i]) - cluster.center).Length());
+	}
+
+	// counter clockwise triangles are the visible ones, their geometric normals point towards the camera
+	Vec3 normals[CLUSTER_SIZE];
+	Vec3 axis;
+	u32 count = 0;
+	for (u32 t = cluster.firstTriangle; t < cluster.firstTriangle + cluster.triangleCount; t++)
+	{
+		Vec3 p[3];
+		for (int k = 0; k < 3; k++)
+		{
+			const u32 i = mesh.GetIndex(t * 3 + k);
+			p[k] = Vec3(mesh.x[i], mesh.y[i], mesh.z[i]);
+		}
+		const Vec3 n = (p[1] - p[0]).Cross(p[2] - p[0]);
+		const f32 length = n.Length();
+		// degenerate triangles are never drawn
+		if (length <= 0) continue;
+		normals[count++] = n / length;
+		axis = axis + n / length;
+	}
+	const f32 axisLength = axis.Length();
+	f32 minDot = 0;
+	if (axisLength > 0)
+	{
+		axis = axis / axisLength;
+		minDot = 1;
+		for (u32 i = 0; i < count; i++)
+		{
+			minDot = Util::MinF(minDot, axis.Dot(normals[i]));
+		}
+	}
+	// cones of 90 degrees or more can not be culled, a zero axis fails the test for every camera
+	if (minDot <= 0)
+	{
+		cluster.coneAxis = Vec3();
+		cluster.coneCutoff = 1;
+	}
+	else
+	{
+		cluster.coneAxis = axis;
+		cluster.coneCutoff = sqrtf(1 - minDot * minDot);
+	}
+}
+
+void Mesh::Destroy()
+{
+	free(block);
+	free(clusters);
+	*this = Mesh();
+}
+
+// Unfolds a normal mapped on the octahedron by EncodeOctahedral
+Vec3 DecodeOctahedral(s16 a, s16 b)
+{
+	f32 x = a / 32767.0f;
+	f32 y = b / 32767.0f;
+	const f32 z = 1 - fabsf(x) - fabsf(y);
+	if (z < 0)
+	{
+		const f32 tx = (1 - fabsf(y)) * (x < 0 ? -1 : 1);
+		y = (1 - fabsf(x)) * (y < 0 ? -1 : 1);
+		x = tx;
+	}
+	return Vec3(x, y, z).Normalize();
+}
+
+// Reads one component of the vertices: raw floats are used in place,
+// 16 bit fractions of [low, high] are decoded into the next array of storage
+bool ReadComponent(SectionReader& in, u32 count, bool quantized, f32 low, f32 high, f32*& storage, f32*& dst)
+{
+	if (!quantized)
+	{
+		dst = static_cast<f32*>(in.Take((u64)count * sizeof(f32)));
+		return dst != NULL;
+	}
+	const u16* src = static_cast<const u16*>(in.Take((u64)count * sizeof(u16)));
+	if (src == NULL) return false;
+	dst = storage;
+	storage += count;
+	const f32 step = (high - low) / 65535;
+	for (u32 i = 0; i < count; i++)
+	{
+		dst[i] = low + src[i] * step;
+	}
+	return true;
+}
+
+// Number of vertex components that ReadVertices has to decode rather than use in place
+u32 DecodedComponents(const ModelHeader& header)
+{
+	return (header.flags & positionQuantized ? 3 : 0) + (header.flags & normalOctahedral ? 3 : 0) + (header.flags & uvQuantized ? 2 : 0);
+}
+
+// Points the arrays of the mesh to the vertex attributes section, storage receives the decoded components
+bool ReadVertices(const ModelHeader& header, SectionReader& in, f32* storage, Mesh& mesh)
+{
+	const u32 count = header.vertexCount;
+	f32** positions[3] = { &mesh.x, &mesh.y, &mesh.z };
+	f32** normals[3] = { &mesh.nx, &mesh.ny, &mesh.nz };
+	f32** uvs[2] = { &mesh.u, &mesh.v };
+	for (u32 k = 0; k < 3; k++)
+	{
+		if (!ReadComponent(in, count, header.flags & positionQuantized, header.positionMin[k], header.positionMax[k], storage, *positions[k])) return false;
+	}
+	if (header.flags & normalOctahedral)
+	{
+		const s16* a = static_cast<const s16*>(in.Take((u64)count * sizeof(s16)));
+		const s16* b = static_cast<const s16*>(in.Take((u64)count * sizeof(s16)));
+		if (a == NULL || b == NULL) return false;
+		for (u32 k = 0; k < 3; k++)
+		{
+			*normals[k] = storage + k * count;
+		}
+		storage += 3 * count;
+		for (u32 i = 0; i < count; i++)
+		{
+			const Vec3 n = DecodeOctahedral(a[i], b[i]);
+			mesh.nx[i] = n.x;
+			mesh.ny[i] = n.y;
+			mesh.nz[i] = n.z;
+		}
 	}
-	for (u32 i = 0; i < fCount; i++)
+	else
 	{
-		Triangle* t = tris + i;
-		f32* ptr = reinterpret_cast<f32*>(t->data);
-		for (u32 j = 0; j < 24; j++)
+		for (u32 k = 0; k < 3; k++)
 		{
-			ptr[j] = tData[pos];
-			pos++;
+			if (!ReadComponent(in, count, false, 0, 0, storage, *normals[k])) return false;
 		}
 	}
-	u32 texSize = fData[pos];
+	for (u32 k = 0; k < 2; k++)
+	{
+		if (!ReadComponent(in, count, header.flags & uvQuantized, header.uvMin[k], header.uvMax[k], storage, *uvs[k])) return false;
+	}
+	return true;
+}
+
+// Reads the clusters of a model file, NULL when they do not cover the triangles in order
+// or reference vertices outside of their range
+Cluster* ReadClusters(const u32* src, u32 clusterCount, const Mesh& mesh)
+{
+	Cluster* clusters = (Cluster*)(malloc(clusterCount * sizeof(Cluster)));
+	if (clusters == NULL) return NULL;
+	u32 next = 0;
+	for (u32 k = 0; k < clusterCount; k++, src += clusterWords)
+	{
+		Cluster& cluster = clusters[k];
+		cluster.firstTriangle = src[0];
+		cluster.triangleCount = src[1];
+		cluster.firstVertex = src[2];
+		cluster.vertexCount = src[3];
+		bool valid = cluster.firstTriangle == next && cluster.triangleCount <= (mesh.indexCount / 3) - next &&
+			cluster.firstVertex <= mesh.vertexCount && cluster.vertexCount <= mesh.vertexCount - cluster.firstVertex;
+		for (u32 i = cluster.firstTriangle * 3; valid && i < (cluster.firstTriangle + cluster.triangleCount) * 3; i++)
+		{
+			valid = mesh.GetIndex(i) - cluster.firstVertex < cluster.vertexCount;
+		}
+		if (!valid)
+		{
+			free(clusters);
+			return NULL;
+		}
+		next += cluster.triangleCount;
+		const f32* values = reinterpret_cast<const f32*>(src + 4);
+		cluster.center = Vec3(values[0], values[1], values[2]);
+		cluster.radius = values[3];
+		cluster.coneAxis = Vec3(values[4], values[5], values[6]);
+		cluster.coneCutoff = values[7];
+	}
+	if (next != mesh.indexCount / 3)
+	{
+		free(clusters);
+		return NULL;
+	}
+	return clusters;
+}
+
+// Reads a model file starting with a ModelHeader. The index buffer, the raw vertex components
+// and the texture are used in place, so the file has to stay open as long as the mesh is used.
+bool ReadModel(const char* source, u32* data, u32 len, Mesh& mesh, Material& material, u8*& texture, u32& textureSize, u32& textureFlags)
+{
+	const u32 version = len < 2 ? 0 : data[1];
+	if (version != modelVersion)
+	{
+		printf("Error - file %s uses version %d of the model format, only version %d is supported, convert the model again\n", source, version, modelVersion);
+		return false;
+	}
+	if (len < headerWords)
+	{
+		printf("Error - file %s is truncated\n", source);
+		return false;
+	}
+	ModelHeader header;
+	memcpy(&header, data, sizeof(header));
+	material.shininess = header.shininess;
+	if (header.indexCount % 3 || header.clusterCount == 0)
+	{
+		printf("Error - file %s is corrupted\n", source);
+		return false;
+	}
+	const size_t bytes = (size_t)header.vertexCount * DecodedComponents(header) * sizeof(f32);
+	f32* storage = (f32*)(malloc(bytes));
+	if (storage == NULL && bytes)
+	{
+		printf("Error - failed to allocate %zu bytes\nOut of memory?", bytes);
+		return false;
+	}
+	mesh.vertexCount = header.vertexCount;
+	mesh.indexCount = header.indexCount;
+	mesh.block = storage;
+	SectionReader in = { data, len, headerWords };
+	const bool hasVertices = ReadVertices(header, in, storage, mesh);
+	void* indices = in.Take((u64)header.indexCount * (header.vertexCount <= 0x10000 ? sizeof(u16) : sizeof(u32)));
+	mesh.indices16 = header.vertexCount <= 0x10000 ? static_cast<u16*>(indices) : NULL;
+	mesh.indices32 = header.vertexCount <= 0x10000 ? NULL : static_cast<u32*>(indices);
+	const u32* clusters = static_cast<const u32*>(in.Take((u64)header.clusterCount * clusterWords * sizeof(u32)));
+	texture = static_cast<u8*>(in.Take(header.textureSize));
+	textureSize = header.textureSize;
+	textureFlags = header.flags & textureLevels;
+	if (!hasVertices || indices == NULL || clusters == NULL || texture == NULL)
+	{
+		printf("Error - file %s is truncated\n", source);
+		mesh.Destroy();
+		return false;
+	}
+	mesh.clusters = ReadClusters(clusters, header.clusterCount, mesh);
+	if (mesh.clusters == NULL)
+	{
+		printf("Error - file %s is corrupted\n", source);
+		mesh.Destroy();
+		return false;
+	}
+	mesh.clusterCount = header.clusterCount;
+	return true;
+}
+
+// Reads the levels of a texture stored ready to sample, they are used in place
+u32* ReadTexture(u8* data, u32 size, IVec2& res, u32& levels)
+{
+	SectionReader in = { reinterpret_cast<u32*>(data), size / (u32)(sizeof(u32)), 0 };
+	const u32* info = static_cast<const u32*>(in.Take(4 * sizeof(u32)));
+	if (info == NULL || info[0] == 0 || info[1] == 0 || info[0] > 0x8000 || info[1] > 0x8000)
+	{
+		printf("Error - texture is corrupted\n");
+		return NULL;
+	}
+	if (info[2] != Texture::SamplingLayout())
+	{
+		printf("Error - texture was prepared with other texture options, convert the model again\n");
+		return NULL;
+	}
+	res = IVec2(info[0], info[1]);
+	const u64 texels = Texture::LevelsSize(res, info[3]);
+	if (texels == 0)
+	{
+		printf("Error - texture is corrupted\n");
+		return NULL;
+	}
+	u32* texture = static_cast<u32*>(in.Take(texels * ((info[2] >> 8) & 0xff)));
+	if (texture == NULL)
+	{
+		printf("Error - texture is truncated\n");
+		return NULL;
+	}
+	levels = info[3];
+	return texture;
+}
+
+// Reads a file in the layout used before the header existed, vertices are merged and clusters made at load time
+bool ReadLegacyModel(const char* source, u32* data, u32 len, Mesh& mesh, u8*& texture, u32& textureSize)
+{
+	u32 pos = 0;
+	u32 fCount = data[0];
+	pos++;
+	if (pos + fCount * 3 * vertexFloats >= len)
+	{
+		printf("Error - file %s is truncated\n", source);
+		return false;
+	}
+	const u32* corners = data + pos;
+	pos += fCount * 3 * vertexFloats;
+	u32 texSize = data[pos];
 	pos++;
+	if (texSize > len - pos)
+	{
+		printf("Error - file %s is truncated\n", source);
+		return false;
+	}
+	texture = reinterpret_cast<u8*>(data + pos);
+	textureSize = texSize * sizeof(u32);
+
+	// legacy files have no clusters, they get runs of CLUSTER_SIZE triangles
+	u32 clusterCount = 0;
+	Cluster* clusters = SplitClusters(fCount, clusterCount);
+	if (clusters == NULL || !BuildMesh(corners, fCount * 3, clusters, clusterCount, mesh))
+	{
+		free(clusters);
+		return false;
+	}
+	for (u32 k = 0; k < clusterCount; k++)
+	{
+		ComputeClusterBounds(mesh, clusters[k]);
+	}
+	return true;
+}
+
+ModelData ModelLoader::ParseModelFile(const char* source, const char* skybox)
+{
+	ModelData result;
+	ModelFile file;
+	if (!OpenModelFile(source, file))
+	{
+		return result;
+	}
+	u32 len = file.size / sizeof(u32);
+	u32* fData = file.data;
+	u8* texPtr = NULL;
+	u32 texSize = 0;
+	u32 texFlags = 0;
+	// legacy files are copied entirely, newer ones keep pointing into the file
+	const bool inPlace = len > 0 && fData[0] == modelMagic;
+	const bool loaded = inPlace ?
+		ReadModel(source, fData, len, result.mesh, result.material, texPtr, texSize, texFlags) :
+		ReadLegacyModel(source, fData, len, result.mesh, texPtr, texSize);
+	if (!loaded)
+	{
+		file.Close();
+		return result;
+	}
 	s32 comp;
-	assert(pos + texSize <= len);
-	u8* texPtr = reinterpret_cast<u8*>(fData + pos);
-	u8* texData = stbi_load_from_memory(texPtr, texSize * sizeof(u32), &result.tRes.x, &result.tRes.y, &comp, 4);
+	u8* texData = NULL;
+	if (texFlags)
+	{
+		texData = reinterpret_cast<u8*>(ReadTexture(texPtr, texSize, result.tRes, result.texLevels));
+	}
+	else
+	{
+		texData = stbi_load_from_memory(texPtr, texSize, &result.tRes.x, &result.tRes.y, &comp, 4);
+		if (texData == NULL) printf("Error - failed to load texture: %s\n", stbi_failure_reason());
+	}
 	if (texData == NULL)
 	{
-		printf("Error - failed to load texture: %s\n", stbi_failure_reason());
-		free(data);
+		result.mesh.Destroy();
+		file.Close();
 		return result;
 	}
 
@@ -493,11 +1409,11 @@ ModelData ModelLoader::ParseModelFile(const char* source, const char* skybox, u3
 		}
 	}
 	
-	result.faces = tris;
 	result.tex = reinterpret_cast<u32*>(texData);
 	result.sky = reinterpret_cast<u32*>(texData2);
 	result.sRes = tmpRes;
-	free(data);
+	if (inPlace) result.file = file;
+	else file.Close();
 	return result;
 }
 
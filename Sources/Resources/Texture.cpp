@@ -6,79 +6,390 @@
 using namespace Resources;
 using namespace Maths;
 
-Texture::Texture() : buffer(NULL)
+#ifdef BLOCK_TEXTURES
+// Blocks are stored row after row, and so are the texels inside a block
+const s32 blockBits = 2;
+const s32 blockSide = 1 << blockBits;
+#endif
+
+// Row stride of a level in its memory layout
+inline s32 LevelStride(IVec2 res)
+{
+#ifdef BLOCK_TEXTURES
+    return (res.x + blockSide - 1) >> blockBits;
+#else
+    return res.x;
+#endif
+}
+
+// Number of texels allocated for a level, sides are rounded up to whole blocks
+inline u64 LevelSize(IVec2 res)
+{
+#ifdef BLOCK_TEXTURES
+    return (u64)(LevelStride(res)) * ((res.y + blockSide - 1) >> blockBits) * blockSide * blockSide;
+#else
+    return (u64)(res.x) * res.y;
+#endif
+}
+
+inline u32 TexelIndex(s32 x, s32 y, s32 stride)
+{
+#ifdef BLOCK_TEXTURES
+    return (((y >> blockBits) * stride + (x >> blockBits)) << (2 * blockBits)) + ((y & (blockSide - 1)) << blockBits) + (x & (blockSide - 1));
+#else
+    return x + y * stride;
+#endif
+}
+
+Texture::Texture() : buffer(NULL), owned(false), mipCount(0), mipBlock(NULL), native(NULL)
 {
 }
 
-Texture::Texture(u32* buffer, IVec2 res) :
+Texture::Texture(u32* buffer, IVec2 res, bool owned) :
     buffer(buffer),
+    owned(owned),
     resolution(res),
-    lResolution((1 << Util::ULog2(res.x)) - 1, (1 << Util::ULog2(res.y)) - 1)
+    lResolution((1 << Util::ULog2(res.x)) - 1, (1 << Util::ULog2(res.y)) - 1),
+    mipCount(1),
+    mipBlock(NULL),
+    native(NULL)
+{
+    mips[0].pixels = buffer;
+    mips[0].resolution = resolution;
+    mips[0].lResolution = lResolution;
+    mips[0].stride = LevelStride(resolution);
+#ifdef BLOCK_TEXTURES
+    if (buffer) ConvertToBlocks();
+#endif
+}
+
+// Levels of a texture stored ready to sample, as written by the model converter
+Texture Texture::FromLevels(void* texels, IVec2 res, u32 levelCount)
+{
+    Texture result;
+    result.resolution = res;
+    result.lResolution = IVec2((1 << Util::ULog2(res.x)) - 1, (1 << Util::ULog2(res.y)) - 1);
+    result.mipCount = levelCount;
+#ifdef NATIVE_TEXTURES
+    result.native = static_cast<Pixel*>(texels);
+    Pixel* level = result.native;
+#else
+    result.buffer = static_cast<u32*>(texels);
+    u32* level = result.buffer;
+#endif
+    for (u32 l = 0; l < levelCount; l++)
+    {
+        MipLevel& mip = result.mips[l];
+        mip.resolution = l ? IVec2(Util::MaxI(result.mips[l - 1].resolution.x / 2, 1), Util::MaxI(result.mips[l - 1].resolution.y / 2, 1)) : res;
+        mip.lResolution = IVec2((1 << Util::ULog2(mip.resolution.x)) - 1, (1 << Util::ULog2(mip.resolution.y)) - 1);
+        mip.stride = LevelStride(mip.resolution);
+#ifdef NATIVE_TEXTURES
+        mip.native = level;
+#else
+        mip.pixels = level;
+#endif
+        level += LevelSize(mip.resolution);
+    }
+    return result;
+}
+
+u32 Texture::SamplingLayout()
+{
+    u32 layout = 0;
+#ifdef BLOCK_TEXTURES
+    layout |= 0x1;
+#endif
+#ifdef MIPMAPS
+    layout |= 0x2;
+#endif
+#ifdef NATIVE_TEXTURES
+    // the size tells the 16 bit Pixel of Sedna from the 32 bit one of windows
+    layout |= 0x4 | (u32)(sizeof(Pixel)) << 8;
+#ifdef TEX_ALPHA
+    layout |= 0x8;
+#endif
+#else
+    layout |= (u32)(sizeof(u32)) << 8;
+#endif
+    return layout;
+}
+
+u64 Texture::LevelsSize(IVec2 res, u32 levelCount)
 {
+    if (levelCount == 0 || levelCount > maxMipLevels) return 0;
+    u64 total = 0;
+    for (u32 l = 0; l < levelCount; l++)
+    {
+        total += LevelSize(res);
+        // a level past the one texel one means the count does not come from this size
+        if (res.x == 1 && res.y == 1 && l + 1 < levelCount) return 0;
+        res = IVec2(Util::MaxI(res.x / 2, 1), Util::MaxI(res.y / 2, 1));
+    }
+    return total;
 }
 
 void Texture::Destroy()
 {
-	if (buffer) ModelLoader::FreeImageData(buffer);
+	if (buffer && owned) ModelLoader::FreeImageData(buffer);
+	if (native && owned) free(native);
+	free(mipBlock);
+	mipBlock = NULL;
+	native = NULL;
+	mipCount = buffer ? 1 : 0;
 }
 
-Vec3 Texture::SampleCube(Vec3 dir) const
+bool Texture::Prepare(bool mipmaps, bool alphaTest)
 {
-    IVec2 r = ProcessDirection(dir);
-    u32 face = r.x;
-    u32 index = r.y;
-    u32 col = buffer[index + face * resolution.x * resolution.x];
-    Vec3 result;
-    result.x = (f32)(col & 0xff);
-    result.y = (f32)((col >> 8) & 0xff);
-    result.z = (f32)((col >> 16) & 0xff);
-    return result;
+#ifdef MIPMAPS
+    if (mipmaps && !GenerateMipmaps()) return false;
+#else
+    (void)mipmaps;
+#endif
+#ifdef NATIVE_TEXTURES
+    return ConvertToPixels(alphaTest);
+#else
+    (void)alphaTest;
+    return IsValid();
+#endif
 }
 
-Vec4 Texture::Sample(Vec2 uv) const
+// Reorders the row major texels of a freshly loaded texture into its block layout.
+// The texture is left invalid if the copy cannot be allocated.
+bool Texture::ConvertToBlocks()
 {
-    u32 index = GetIndexFromUV(uv);
-    u32 col = buffer[index];
-    Vec4 result;
-    result.x = (f32)(col & 0xff);
-    result.y = (f32)((col >> 8) & 0xff);
-    result.z = (f32)((col >> 16) & 0xff);
-    result.w = (f32)((col >> 24) & 0xff);
-    return result;
+    const u64 size = LevelSize(resolution);
+    u32* blocks = (u32*)(malloc(size * sizeof(u32)));
+    if (blocks == NULL)
+    {
+        printf("Error - failed to allocate %llu bytes for texture blocks\nOut of memory?", (unsigned long long)(size * sizeof(u32)));
+        if (owned) ModelLoader::FreeImageData(buffer);
+        buffer = NULL;
+        mips[0].pixels = NULL;
+        mipCount = 0;
+        return false;
+    }
+    const s32 stride = mips[0].stride;
+    for (s32 y = 0; y < resolution.y; y++)
+    {
+        for (s32 x = 0; x < resolution.x; x++)
+        {
+            blocks[TexelIndex(x, y, stride)] = buffer[x + y * resolution.x];
+        }
+    }
+    // the copy comes from malloc like stb_image buffers, so Destroy frees it the same way
+    if (owned) ModelLoader::FreeImageData(buffer);
+    buffer = blocks;
+    owned = true;
+    mips[0].pixels = buffer;
+    return true;
 }
 
-u32 Texture::SampleCubeRaw(Vec3 dir) const
+bool Texture::GenerateMipmaps()
 {
-    IVec2 r = ProcessDirection(dir);
-    u32 face = r.x;
-    u32 index = r.y;
-    return buffer[index + face * resolution.x * resolution.x];
+    if (!buffer || mipBlock) return false;
+    // sizes of the levels, halved until both sides reach one texel
+    u32 count = 1;
+    u64 total = 0;
+    IVec2 res = resolution;
+    while ((res.x > 1 || res.y > 1) && count < maxMipLevels)
+    {
+        res = IVec2(Util::MaxI(res.x / 2, 1), Util::MaxI(res.y / 2, 1));
+        total += LevelSize(res);
+        count++;
+    }
+    if (count == 1) return true;
+    mipBlock = (u32*)(malloc(total * sizeof(u32)));
+    if (mipBlock == NULL)
+    {
+        printf("Error - failed to allocate %llu bytes for mipmaps\nOut of memory?", (unsigned long long)(total * sizeof(u32)));
+        return false;
+    }
+
+    u32* dst = mipBlock;
+    for (u32 l = 1; l < count; l++)
+    {
+        const MipLevel& src = mips[l - 1];
+        MipLevel& level = mips[l];
+        level.pixels = dst;
+        level.resolution = IVec2(Util::MaxI(src.resolution.x / 2, 1), Util::MaxI(src.resolution.y / 2, 1));
+        level.lResolution = IVec2((1 << Util::ULog2(level.resolution.x)) - 1, (1 << Util::ULog2(level.resolution.y)) - 1);
+        level.stride = LevelStride(level.resolution);
+        for (s32 y = 0; y < level.resolution.y; y++)
+        {
+            // odd sides repeat their last texel
+            const s32 y0 = Util::MinI(y * 2, src.resolution.y - 1);
+            const s32 y1 = Util::MinI(y * 2 + 1, src.resolution.y - 1);
+            for (s32 x = 0; x < level.resolution.x; x++)
+            {
+                const s32 x0 = Util::MinI(x * 2, src.resolution.x - 1);
+                const s32 x1 = Util::MinI(x * 2 + 1, src.resolution.x - 1);
+                const u32 texels[4] = { src.pixels[TexelIndex(x0, y0, src.stride)], src.pixels[TexelIndex(x1, y0, src.stride)],
+                    src.pixels[TexelIndex(x0, y1, src.stride)], src.pixels[TexelIndex(x1, y1, src.stride)] };
+                u32 result = 0;
+                for (u32 shift = 0; shift < 32; shift += 8)
+                {
+                    u32 sum = 2;
+                    for (u32 i = 0; i < 4; i++)
+                    {
+                        sum += (texels[i] >> shift) & 0xff;
+                    }
+                    result |= (sum >> 2) << shift;
+                }
+                dst[TexelIndex(x, y, level.stride)] = result;
+            }
+        }
+        dst += LevelSize(level.resolution);
+    }
+    mipCount = count;
+    return true;
 }
 
-u32 Texture::SampleRaw(Vec2 uv) const
+bool Texture::ConvertToPixels(bool alphaTest)
 {
-    u32 index = GetIndexFromUV(uv);
-    return buffer[index];
+    if (!buffer || native) return false;
+    u64 total = 0;
+    for (u32 l = 0; l < mipCount; l++)
+    {
+        total += LevelSize(mips[l].resolution);
+    }
+    native = (Pixel*)(malloc(total * sizeof(Pixel)));
+    if (native == NULL)
+    {
+        printf("Error - failed to allocate %llu bytes for texture pixels\nOut of memory?", (unsigned long long)(total * sizeof(Pixel)));
+        return false;
+    }
+
+    // the levels keep their layout, only the size of a texel changes
+    Pixel* dst = native;
+    for (u32 l = 0; l < mipCount; l++)
+    {
+        MipLevel& level = mips[l];
+        const u64 size = LevelSize(level.resolution);
+        for (u64 i = 0; i < size; i++)
+        {
+            const u32 col = level.pixels[i];
+            Pixel p = PackChannels((col & 0xff) >> 3, ((col >> 8) & 0xff) >> 2, ((col >> 16) & 0xff) >> 3);
+            // opaque texels of the transparent color move to the closest one
+            if (alphaTest && p == transparentPixel) p = PackChannels(0, 0, 0);
+            if (alphaTest && (col >> 24) < 128) p = transparentPixel;
+            dst[i] = p;
+        }
+        level.native = dst;
+        level.pixels = NULL;
+        dst += size;
+    }
+    if (owned) ModelLoader::FreeImageData(buffer);
+    free(mipBlock);
+    buffer = NULL;
+    mipBlock = NULL;
+    owned = true;
+    return true;
 }
 
-u32 Resources::Texture::GetIndexFromUV(Vec2 uv) const
+const void* Texture::GetLevelTexels(u32 level, u64& bytes) const
 {
-    s32 x = (s32)(floorf(uv.x * resolution.x));
-    s32 y = (s32)(floorf(uv.y * resolution.y));
+    const MipLevel& mip = mips[level];
+    if (native)
+    {
+        bytes = LevelSize(mip.resolution) * sizeof(Pixel);
+        return mip.native;
+    }
+    bytes = LevelSize(mip.resolution) * sizeof(u32);
+    return mip.pixels;
+}
+
+u32 Texture::GetMipLevel(f32 uvPerPixel) const
+{
+    const f32 texels = uvPerPixel * resolution.x * resolution.y;
+    // written so that NaN picks level 0 as well
+    if (!(texels > 1)) return 0;
+    // each level divides the texel area by 4, rounding half a level up
+    const s32 level = ilogbf(texels * 2) >> 1;
+    return level < (s32)mipCount ? level : mipCount - 1;
+}
+
+void Texture::SampleCubeSpan(Vec3 dir, const Vec3& step, u32 count, Pixel* out) const
+{
+    for (u32 i = 0; i < count; i++, dir = dir + step)
+    {
+        // the largest component picks the face, dividing by it scales the other two onto the face
+        const f32 ax = fabsf(dir.x);
+        const f32 ay = fabsf(dir.y);
+        const f32 az = fabsf(dir.z);
+        u32 axis;
+        Vec2 uv;
+        f32 major;
+        if (ax > ay && ax > az)
+        {
+            axis = 0;
+            major = dir.x;
+            uv = Vec2(dir.y, dir.z);
+        }
+        else if (!(ax > ay) && ay > az)
+        {
+            axis = 1;
+            major = dir.y;
+            uv = Vec2(dir.x, dir.z);
+        }
+        else
+        {
+            axis = 2;
+            major = dir.z;
+            uv = Vec2(dir.x, dir.y);
+        }
+        const u32 index = GetIndexFromUVCubed(uv * (0.5f / major) + 0.5f, axis * 2 + (major < 0 ? 1 : 0));
+        if (native)
+        {
+            out[i] = native[index];
+        }
+        else
+        {
+            const u32 color = buffer[index];
+            out[i] = PackColor(((color & 0xff) << 16) | (color & 0xff00) | ((color & 0xff0000) >> 16));
+        }
+    }
+}
+
+#ifdef NATIVE_TEXTURES
+Pixel Texture::SamplePixel(Vec2 uv, u32 level) const
+{
+    const MipLevel& mip = mips[level];
+    return mip.native[GetIndexFromUV(uv, mip)];
+}
+#else
+Vec4 Texture::Sample(Vec2 uv, u32 level) const
+{
+    const MipLevel& mip = mips[level];
+    u32 col = mip.pixels[GetIndexFromUV(uv, mip)];
+    Vec4 result;
+    result.x = (f32)(col & 0xff);
+    result.y = (f32)((col >> 8) & 0xff);
+    result.z = (f32)((col >> 16) & 0xff);
+    result.w = (f32)((col >> 24) & 0xff);
+    return result;
+}
+#endif
+
+u32 Resources::Texture::GetIndexFromUV(Vec2 uv, const MipLevel& level) const
+{
+    const IVec2& res = level.resolution;
+    s32 x = (s32)(floorf(uv.x * res.x));
+    s32 y = (s32)(floorf(uv.y * res.y));
 #ifndef TEX_REPEAT
     if (x < 0) x = 0;
-    if (x >= resolution.x) x = resolution.x - 1;
+    if (x >= res.x) x = res.x - 1;
     if (y < 0) y = 0;
-    if (y >= resolution.y) y = resolution.y - 1;
+    if (y >= res.y) y = res.y - 1;
 #else
-    x &= lResolution.x;
-    y &= lResolution.y;
+    x &= level.lResolution.x;
+    y &= level.lResolution.y;
 #endif
-    assert(x >= 0 && x < resolution.x && y >= 0 && y < resolution.y);
-    return x + y * resolution.x;
+    assert(x >= 0 && x < res.x && y >= 0 && y < res.y);
+    return TexelIndex(x, y, level.stride);
 }
 
-u32 Resources::Texture::GetIndexFromUVCubed(Vec2 uv) const
+// The faces are stacked vertically, each one resolution.x texels high
+u32 Resources::Texture::GetIndexFromUVCubed(Vec2 uv, u32 face) const
 {
     s32 x = (s32)(floorf(uv.x * resolution.x));
     s32 y = (s32)(floorf(uv.y * resolution.x));
@@ -87,17 +398,5 @@ u32 Resources::Texture::GetIndexFromUVCubed(Vec2 uv) const
     y &= lResolution.x;
 
     assert(x >= 0 && x < resolution.x && y >= 0 && y < resolution.x);
-    return x + y * resolution.x;
-}
-
-IVec2 Texture::ProcessDirection(Maths::Vec3 dir) const
-{
-    dir = dir.Normalize();
-    u32 i = dir.GetLargestScalar();
-    f32 val = dir[i];
-    dir = dir / val; // intersect with cube surface
-    Vec2 uv = dir.DeleteScalarAt(i);
-    u32 face = i * 2 + (val < 0 ? 1 : 0);
-    u32 index = GetIndexFromUVCubed((uv + 1) * 0.5f);
-    return IVec2(face, index);
+    return TexelIndex(x, y + face * resolution.x, mips[0].stride);
 }
@@ -0,0 +1,191 @@
+#include "WorkerPool.hpp"
+
+#include <stdio.h>
+
+using namespace Core;
+
+WorkerPool::~WorkerPool()
+{
+	Destroy();
+}
+
+#ifndef _WIN32
+bool WorkerPool::Init(u32 count)
+{
+	if (count > MAX_WORKERS) count = MAX_WORKERS;
+	if (count <= 1) return true;
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&wake, NULL);
+	pthread_cond_init(&done, NULL);
+	generation = 0;
+	quit = false;
+	for (u32 i = 1; i < count; i++)
+	{
+		infos[i].pool = this;
+		infos[i].index = i;
+		if (pthread_create(&threads[i], NULL, ThreadMain, &infos[i]))
+		{
+			printf("Warning - could only start %d worker threads\n", i);
+			count = i;
+			break;
+		}
+	}
+	if (count <= 1)
+	{
+		// no thread to stop, Destroy will skip the synchronization objects
+		pthread_cond_destroy(&done);
+		pthread_cond_destroy(&wake);
+		pthread_mutex_destroy(&lock);
+	}
+	workerCount = count;
+	return workerCount > 1;
+}
+
+void WorkerPool::Destroy()
+{
+	if (workerCount <= 1) return;
+
+	pthread_mutex_lock(&lock);
+	quit = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+	for (u32 i = 1; i < workerCount; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	pthread_cond_destroy(&done);
+	pthread_cond_destroy(&wake);
+	pthread_mutex_destroy(&lock);
+	workerCount = 1;
+}
+
+void* WorkerPool::ThreadMain(void* arg)
+{
+	WorkerInfo* info = static_cast<WorkerInfo*>(arg);
+	WorkerPool* pool = info->pool;
+	u32 seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	while (true)
+	{
+		while (seen == pool->generation && !pool->quit)
+		{
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		if (pool->quit) break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->Work(info->index);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+		{
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+#else
+bool WorkerPool::Init(u32 count)
+{
+	// The windows demo renders on its own thread already, tasks run inline there
+	(void)count;
+	return false;
+}
+
+void WorkerPool::Destroy()
+{
+}
+#endif
+
+void WorkerPool::Run(TaskCallback func, void* data, u32 taskCount)
+{
+	if (workerCount <= 1)
+	{
+		for (u32 i = 0; i < taskCount; i++)
+		{
+			func(data, 0, i);
+		}
+		return;
+	}
+
+	for (u32 i = 0; i < workerCount; i++)
+	{
+		const u64 head = (u64)taskCount * i / workerCount;
+		const u64 tail = (u64)taskCount * (i + 1) / workerCount;
+		queues[i].range.store(head | (tail << 32), std::memory_order_relaxed);
+	}
+
+#ifndef _WIN32
+	pthread_mutex_lock(&lock);
+	callback = func;
+	callbackData = data;
+	busy = workerCount - 1;
+	generation++;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	Work(0);
+
+	pthread_mutex_lock(&lock);
+	while (busy > 0)
+	{
+		pthread_cond_wait(&done, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+#endif
+}
+
+void WorkerPool::Work(u32 worker)
+{
+	u32 task;
+	while (Pop(worker, task))
+	{
+		callback(callbackData, worker, task);
+	}
+	// own queue is empty, help the others starting with our neighbour
+	for (u32 i = 1; i < workerCount; i++)
+	{
+		const u32 victim = (worker + i) % workerCount;
+		while (Steal(victim, task))
+		{
+			callback(callbackData, worker, task);
+		}
+	}
+}
+
+bool WorkerPool::Pop(u32 worker, u32& task)
+{
+	std::atomic<u64>& range = queues[worker].range;
+	u64 r = range.load(std::memory_order_relaxed);
+	while (true)
+	{
+		const u32 head = (u32)r;
+		const u32 tail = (u32)(r >> 32);
+		if (head >= tail) return false;
+		if (range.compare_exchange_weak(r, (u64)(head + 1) | ((u64)tail << 32)))
+		{
+			task = head;
+			return true;
+		}
+	}
+}
+
+bool WorkerPool::Steal(u32 victim, u32& task)
+{
+	std::atomic<u64>& range = queues[victim].range;
+	u64 r = range.load(std::memory_order_relaxed);
+	while (true)
+	{
+		const u32 head = (u32)r;
+		const u32 tail = (u32)(r >> 32);
+		if (head >= tail) return false;
+		if (range.compare_exchange_weak(r, (u64)head | ((u64)(tail - 1) << 32)))
+		{
+			task = tail - 1;
+			return true;
+		}
+	}
+}